@@ -8,11 +8,16 @@ See main program file for more extensive comments and dependencies
 */
 
 #define DEBUG 0 // Switch debug output on and off by 1 or 0
+#define BENCH_RENDER 0  // Run the render benchmark at startup by 1 or 0
+#define PROFILE_LOOP 1  // Keep loop stage timing histograms for BT diagnostics by 1 or 0
+#define PROFILE_DEBUG 0 // Keep task, demo frame and smooth face timing for the debug output by 1 or 0
+#define REPLAY_TRACE 0  // Replay the input trace at startup and report the response by 1 or 0
 
 // Set the hardware choices
 #define USE_LDR_SENSOR    1   // Use an LDR sensor for auto brightness adjustment
 #define HW_USE_IR         1   // Use the Infrared remote control
 #define HW_USE_BLUETOOTH  1   // Use a Bluetooth interface - need to define type below
+#define HW_USE_RTC_SQW    0   // Use the RTC 1Hz SQW output on an interrupt pin instead of polling the alarm
 // Define the type of BT hardware being used.
 // Only one of these options is enabled at any time.
 // The HM-10 comes in two versions - JHHuaMao (HMSoft) version and Bolutek - AT command line ending differ.
@@ -40,9 +45,55 @@ const CRGB::HTMLColorCode COL_MHAND   = CRGB::Green;        // minute hand
 const CRGB::HTMLColorCode COL_SHAND   = CRGB::Blue;         // second hand
 // ----------------------
 
-// FastLED --------------
-const uint8_t NUM_LEDS = 60;      // number of LEDS in the circle
+// Palette entries ------
+// Clock faces are drawn with these palette indices, the colours come from 
+// the theme in use (Chroniker_Theme.h). COL_* are the colours for theme 0.
+enum palIdx_e { PAL_OFF, PAL_MMARK, PAL_HMARK, PAL_12HMARK, PAL_HHAND, PAL_MHAND, PAL_SHAND, PAL_COUNT };
+// ----------------------
 
+// Smooth clock face ----
+const bool SMOOTH_MHAND = true;     // smooth face also sweeps the minute hand
+const uint16_t SMOOTH_BUDGET = 500; // render time budget per frame (us)
+// ----------------------
+
+// Frame rate governor --
+const uint16_t GOV_PERIOD_IDLE = 20;  // ms per frame for demos and smooth face with quiet inputs
+const uint16_t GOV_PERIOD_BUSY = 80;  // ms per frame while IR or BT input is arriving
+const uint16_t GOV_IDLE_TIME = 1000;  // ms of quiet inputs before the faster rate is used
+// ----------------------
+
+// BT state notify ------
+const uint16_t STATE_NOTIFY_PERIOD = 250; // min ms between state change notifications to the BT master
+// ----------------------
+
+// Settings journal -----
+const uint16_t JNL_DELAY = 5000;  // ms without a settings change before the settings are written to EEPROM
+// ----------------------
+
+// Transitions ----------
+const uint16_t FADE_PERIOD = 20;    // ms between crossfade steps
+const uint16_t FADE_TIME = 400;     // ms to crossfade between display modes, 0 to cut
+// ----------------------
+
+// LED rings ------------
+// The rings chained on the LED data line, in data line order, and what is
+// shown on each ring (RING_* bits). Each ring must have a multiple of 12 
+// LEDs, with the first LED at 12 o'clock. Examples:
+//  { 60 }          { RING_HMS | RING_MARKS }                single 60 ring
+//  { 24 }          { RING_HMS | RING_MARKS }                single 24 ring
+//  { 60, 24, 12 }  { RING_MS, RING_H, RING_MARKS }          concentric stack
+const uint8_t RING_H = 0x01;      // hour hand
+const uint8_t RING_M = 0x02;      // minute hand
+const uint8_t RING_S = 0x04;      // second hand
+const uint8_t RING_MARKS = 0x08;  // hour marks
+const uint8_t RING_MS = RING_M | RING_S;
+const uint8_t RING_HMS = RING_H | RING_M | RING_S;
+
+constexpr uint8_t RING_SIZE[] = { 60 };                       // LEDs in each ring
+constexpr uint8_t RING_SHOW[] = { RING_HMS | RING_MARKS };    // shown on each ring
+// ----------------------
+
+// FastLED --------------
 #define LED_TYPE    WS2812
 #define COLOR_ORDER GRB
 
@@ -66,6 +117,9 @@ const uint8_t STEP_BRIGHTNESS = 4;  // adjustment steps for brightness controls
 
 #if USE_LDR_SENSOR
 const uint8_t LDR_SENSOR = A3;    // light sensitive resistor for brightness
+const uint8_t LDR_PERIOD = 32;    // ms between LDR samples
+const uint8_t LDR_SAMPLES = 16;   // samples the running average is taken over - must be a power of 2
+const uint8_t LDR_HYSTERESIS = 16; // ADC counts the average must move before brightness changes
 #endif
 // ----------------------
 
@@ -80,13 +134,57 @@ const uint8_t BT_SEND_PIN = 9;   // Arduino send -> Bluetooth RxD pin
 const char BT_NAME[] = "Chroniker";
 // ----------------------
 
+// RTC Interface --------
+#if HW_USE_RTC_SQW
+const uint8_t RTC_SQW_PIN = 3;      // pin for the DS3231 INT/SQW output - must support IRQ
+const uint8_t RTC_RESYNC_TIME = 60; // seconds counted locally between RTC reads (1 = read every second)
+#endif
+// ----------------------
+
 // IR Interface ---------
 const uint8_t IR_RECV_PIN = 2;   // pin for the demodulated IR signal - must support IRQ
 // ----------------------
 
+// EEPROM map -----------
+const uint16_t EE_IR_BASE = 0;    // IR remote profile and learned codes
+const uint16_t EE_IR_SIZE = 128;
+const uint16_t EE_THEME_BASE = EE_IR_BASE + EE_IR_SIZE;  // colour theme and user palette
+const uint16_t EE_THEME_SIZE = 32;
+const uint16_t EE_JNL_BASE = EE_THEME_BASE + EE_THEME_SIZE;  // settings journal
+const uint16_t EE_JNL_SIZE = 320;
+// ----------------------
+
+// SRAM budget ----------
+// 2048 bytes less the library buffers (Serial, Wire, SoftwareSerial, 
+// FastLED ~450 bytes) and room for the stack (~300 bytes).
+// BENCH_RENDER, REPLAY_TRACE and PROFILE_DEBUG add their own state and may
+// need PROFILE_LOOP or an input switched off to fit.
+const uint16_t RAM_BUDGET = 1280;  // bytes allowed for the application objects, buffers and state
+// ----------------------
+
 //=====================================================
 //======= END OF USER CONFIGURATION PARAMETERS ========
 //=====================================================
+// LED ring geometry derived from the configuration
+constexpr uint16_t ringStart(uint8_t r)
+// first LED of ring r, the total number of LEDs for r = RING_COUNT
+{
+  return(r == 0 ? 0 : ringStart(r - 1) + RING_SIZE[r - 1]);
+}
+
+constexpr bool ringValid(uint8_t r)
+// true if rings r onwards are all a multiple of 12 LEDs
+{
+  return(r >= ARRAY_SIZE(RING_SIZE) || (RING_SIZE[r] != 0 && RING_SIZE[r] % 12 == 0 && ringValid(r + 1)));
+}
+
+const uint8_t RING_COUNT = ARRAY_SIZE(RING_SIZE);
+const uint8_t NUM_LEDS = ringStart(RING_COUNT);   // number of LEDs on all the rings
+
+static_assert(ARRAY_SIZE(RING_SHOW) == RING_COUNT, "RING_SHOW needs an entry for each ring");
+static_assert(ringValid(0), "LED rings must be a multiple of 12 LEDs");
+static_assert(ringStart(RING_COUNT) <= 255, "Too many LEDs");
+
 // Debugging switches and macros
 #if DEBUG
 #define PRINTS(s)     { Serial.print(F(s)); }
@@ -114,8 +212,13 @@ const uint8_t IR_RECV_PIN = 2;   // pin for the demodulated IR signal - must sup
 #define PRINTFSM(s,f)
 #endif
 
+// Compile time index sequence used to expand PROGMEM tables
+template<uint16_t... I> struct idxSeq {};
+template<uint16_t N, uint16_t... I> struct makeSeq : makeSeq<N - 1, N - 1, I...> {};
+template<uint16_t... I> struct makeSeq<0, I...> { typedef idxSeq<I...> type; };
+
 // Loop() fsm states
-enum runState_e { RUN_INIT, RUN_NORMAL, RUN_SETUP, RUN_DEMO };
+enum runState_e { RUN_INIT, RUN_NORMAL, RUN_SETUP, RUN_DEMO, RUN_LAMPTEST };
 
 // Commands for the cmd queue. Each command may have associated with it a data value that
 // indicates what to do (eg, on or off).
@@ -128,9 +231,16 @@ const char CMD_SETUP    = 'X';  // step through setup mode for the clock
 const char CMD_BRIGHT   = 'B';  // set specified brightness - data = brightness level (3 digits 000-255)
 const char CMD_SELECT   = 'S';  // select command - data 0 = next, 1 = previous
 const char CMD_VALUE    = 'V';  // change value command - data 0 = DOWN, 1 = UP
-const char CMD_TIME     = 'T';  // set the time directly - data = HHMMSS
+const char CMD_TIME     = 'T';  // set the time directly - data = HHMMSS, hours 0-23
 const char CMD_DEMO     = 'D';  // cool light demo - data 0 = off, 9 to cycle
-const char CMD_CLKFACE  = 'C';  // clock face - data 9 to cycle 
+const char CMD_CLKFACE  = 'C';  // clock face - data 0-8 face number, 9 to cycle
+const char CMD_IRMODE   = 'R';  // IR remote - data 0-9 profile number, L to learn codes
+const char CMD_DIAG     = 'G';  // diagnostics snapshot - data 0-9 page number
+const char CMD_THEME    = 'P';  // colour theme - data 0-8 theme number, 9 for the user theme
+const char CMD_COLOUR   = 'U';  // user theme colour - data = palette entry << 24 | RGB colour
+const char CMD_ECHO     = 'K';  // time sync echo - data = master timestamp, returned with the clock millis()
+const char CMD_SYNC     = 'J';  // time sync - data = ms of the day (HHMMSSmmm), compensated for the link delay
+const char CMD_QUERY    = 'Q';  // device state - data 0 = snapshot, 1 = snapshot and notify changes, 2 = stop notifying
 
 // command SELECT data
 const uint8_t CS_NEXT = '0';    // select next
@@ -145,7 +255,19 @@ const uint8_t CD_OFF  = '0';    // demo off
 const uint8_t CD_CYCLE = '9';   // demo cycle
 
 // command CLKFACE data
-const uint8_t CC_CYCLE = '9';   // demo cycle
+const uint8_t CC_CYCLE = '9';   // face cycle, '0'-'8' select the face directly
+const uint8_t CLKFACE_COUNT = 4; // clock faces in clkFace[], so '0' to '3' select a face
+
+// command IRMODE data
+const uint8_t CI_LEARN = 'L';   // learn IR codes, '0'-'9' select the remote profile
+
+// command THEME data
+const uint8_t CT_USER = '9';    // user theme from EEPROM, '0'-'8' select a built in theme
+
+// command QUERY data
+const uint8_t CQ_STATE  = '0';  // send the state snapshot
+const uint8_t CQ_NOTIFY = '1';  // send the state snapshot, then notify changes
+const uint8_t CQ_QUIET  = '2';  // stop notifying changes
 
 typedef struct
 {
@@ -153,11 +275,9 @@ typedef struct
   uint32_t data;   // associated data if needed
 } cmdQ_t;
 
-#define CIR_QUEUE_SIZE 4
-#define ENQUEUE(z)      { Q.push((uint8_t *)&z); }
-#define ENQUEUE_C(c, d) { cmdQ_t cq; cq.cmd=c; cq.data=d; Q.push((uint8_t *)&cq); }
-#define DEQUEUE(z)      { Q.pop((uint8_t *)&z); }
-#define DEQUEUE_C(c, d) { cmdQ_t cq; Q.pop((uint8_t *)&cq); c=cq.cmd; d=cq.data; }
+#define CMD_QUEUE_SIZE 8  // command ring size for the BT and IR inputs - must be a power of 2
+#define UI_QUEUE_SIZE 4   // command ring size for the mode switch - must be a power of 2
+#define CMD_BATCH 4       // max commands processed each time through loop()
 
 // Container class for interface definitions
 class iChroniker
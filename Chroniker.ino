@@ -20,7 +20,9 @@ The seconds will be reset to zero and normal clock will start again.
 The *Bluetooth interface* is self explanatory from the Android application.
 
 The *Infrared remote* interface maps infrared codes from the IR remote 
-interface using the mapping table found in the IR code module.
+interface using the remote profile tables found in the IR code module. 
+The profile can be changed, or codes learned from any remote, using the 
+Bluetooth CMD_IRMODE command.
 
 Library Dependencies:
 --------------------
@@ -39,13 +41,175 @@ Note: Only required when debugging flag is turn on.
 
 * IRReadOnlyRemote https://github.com/otryti/IRReadOnlyRemote
 * MD_KeySwitch     http://github.com/MajicDesigns/MD_KeySwitch
-* MD_CircQueue     http://github.com/MajicDesigns/MD_CirQueue
+
+RTC Timebase
+------------
+By default the DS3231 alarm 1 is set to trigger every second and is polled
+over I2C every time through loop(). Setting HW_USE_RTC_SQW in Chroniker.h
+instead uses the DS3231 1Hz square wave output, wired to RTC_SQW_PIN, to 
+drive an interrupt that flags each second. The time is then kept by 
+counting seconds locally and only read from the RTC every RTC_RESYNC_TIME
+seconds, leaving the I2C bus and CPU free for the rest of the application.
+The number of I2C transactions in the last second is printed with the 
+debug output.
+
+Time Sync
+---------
+The Bluetooth master can keep the clock within a fraction of a second
+of its own time (Chroniker_Sync.h). It measures the link round trip with
+CMD_ECHO, then sends its time of day to the ms plus half the round trip
+with CMD_SYNC. The clock records its offset from that time and sets the
+RTC on the next whole second. The offsets measured over a day or more 
+are used to correct the drift with the DS3231 aging offset register. 
+The last few offsets can be read back with CMD_DIAG. Times can be set with hours 
+0-23, the RTC still runs in 12H mode. The sync data frame returns the
+offset, the aging offset and a status. The status is PKT_ERR_BUSY if the
+sync was refused in setup mode, or if the RTC has not ticked in the last
+second, as the offset could not be measured. A sync waiting for its second is dropped
+if the time is set any other way or setup starts.
+
+Smooth Clock Face
+-----------------
+Clock face 3 sweeps the second hand (and the minute hand if SMOOTH_MHAND
+is set) continuously instead of stepping once a second. The position in 
+the current second is worked out from the millis() elapsed since the last 
+RTC tick and the hand is drawn at an 8.8 fixed point pixel position, with 
+its intensity split between the two adjacent LEDs. The face is redrawn 
+at the demo frame rate. With PROFILE_DEBUG set, render time per frame
+is checked against the SMOOTH_BUDGET and the statistics are printed with
+the debug output.
+
+LED Rings
+---------
+The LEDs can be one ring of any multiple of 12 LEDs (eg, 12, 24, 60 or 
+120) or several concentric rings chained on the same data line (eg, 60 + 
+24 + 12), set up by RING_SIZE and RING_SHOW in Chroniker.h. Each ring can
+show any of the hands and the hour marks. The mapping of the time to the
+LEDs on each ring is worked out at compile time (Chroniker_Ring.h), so 
+rendering a frame needs no divisions.
+
+Colour Themes
+-------------
+The clock faces are drawn into a pixel buffer of palette entries with an
+intensity for each LED, which is only expanded to colours when the frame
+is sent to the LEDs. The colours come from the selected theme - built in
+themes are in PROGMEM and a user theme, with colours that can be set over
+Bluetooth (CMD_COLOUR), is in EEPROM. Selecting a theme (CMD_THEME) only
+loads a new palette and expands the frame again, with no redraw. The
+demos and lamp test still draw colours directly into the LED buffer.
+
+Transitions
+-----------
+Changes of clock face, demo on and off, and setup mode on and off are 
+crossfaded over FADE_TIME instead of cut (Chroniker_Fade.h). The frame 
+being shown is held in a second frame buffer that is blended towards the
+new frame every FADE_PERIOD, so the faces and demos keep drawing in the
+normal way while the transition runs. The time for each blend is 
+measured and reported with the diagnostics.
+
+Frame Rate Governor
+-------------------
+FastLED.show() blocks interrupts, which corrupts IR and BT data being
+received. The demos and smooth face run every GOV_PERIOD_IDLE while the 
+inputs are quiet, drop to GOV_PERIOD_BUSY as soon as an IR edge or BT 
+character arrives, and only return to the faster rate after GOV_IDLE_TIME
+with no input (Chroniker_Gov.h). The time, LED updates, and IR codes
+decoded and malformed are counted for each rate so the periods can be 
+tuned.
+
+Render Benchmark
+----------------
+Setting BENCH_RENDER in Chroniker.h runs a benchmark of the render paths
+once at startup, before the clock starts. Every hour/minute/second is
+rendered for each clock face (also with blinking hands as in setup mode)
+and a fixed number of frames are rendered for each demo. The LED update
+is suppressed while this runs, so only the render cost is measured. 
+Results are printed to the Serial monitor as time and CPU cycles per 
+frame (average and maximum) and the average LED bytes changed per frame.
+
+Tasks
+-----
+loop() only runs the cooperative task scheduler (Chroniker_Task.h) and 
+nothing in the application waits with delay() or a busy loop. Input 
+polling and command processing, the display FSM (clock, setup blink and 
+demos), the lamp test steps, the wait for the mode switch held at 
+power up to be released and the BT state notifications are each a task.
+The lamp test is stopped by any other command. With PROFILE_DEBUG set in
+Chroniker.h, run time and the longest interval between runs for each
+task are printed with the debug output - for the input task this is the 
+worst case input latency.
+
+Diagnostics
+-----------
+Setting PROFILE_LOOP in Chroniker.h times the loop stages (whole pass, 
+input polling, command dispatch, display FSM and FastLED.show()) into 
+small histograms (Chroniker_Prof.h). These and counters for LED updates,
+queue drops, BT errors and the crossfade blend time, and the frame rate
+governor statistics, can be read back over Bluetooth with the CMD_DIAG 
+command, one page per request, so a unit can be profiled without a 
+serial cable or the debug build.
+
+State Query
+-----------
+The Bluetooth master can read the whole device state (run state, time, 
+brightness, clock face, demo and theme) in one data frame with the 
+CMD_QUERY command. With CQ_NOTIFY the clock then also sends only the 
+fields that change, whether from the switch, IR or BT, at most every 
+STATE_NOTIFY_PERIOD and only when the BT link is idle, until CQ_QUIET is
+received. The seconds are only sent with a change of minute, so a clock
+showing the time does not notify every second. The application stays in
+step without polling. A query is rejected with PKT_ERR_FULL if there is
+no room to send the snapshot back.
+
+Settings Journal
+----------------
+The brightness, clock face and demo are restored at power up from a 
+journal in EEPROM (Chroniker_Journal.h), read in a single scan. Changes
+are written JNL_DELAY after the last one, only for the settings that 
+changed, and each write goes to the next slot around the journal block 
+to spread the EEPROM wear. A checksum in each record means a write cut 
+short by a power loss falls back to the previous value.
+
+Input Trace Replay
+------------------
+Setting REPLAY_TRACE in Chroniker.h plays the recorded input events in
+Chroniker_Replay.h (BT characters, IR codes, switch presses, LDR levels
+and RTC time) into the inputs at startup. The latency from each event to
+the first frame sent to the LEDs is reported on the Serial monitor, and 
+the frame hash is checked against the golden value in the trace, so 
+changes to the input and render paths can be regression tested.
+
+Memory Use
+----------
+Nothing is allocated on the heap. The interface objects hold their 
+driver library objects and buffers as members and all other state is in
+static storage, so the SRAM use is fixed at compile time. The size of the
+application objects and buffers, plus the file scope state variables, is
+checked against RAM_BUDGET in Chroniker.h by a static_assert, and the
+size for each module is printed with the debug output. New file scope
+state must be added to RAM_STATE. The timing statistics only printed with
+the debug output are left out unless PROFILE_DEBUG is set. Flash and SRAM
+use for each symbol in the built sketch can be listed with
+'avr-nm --size-sort -C -S' on the .elf file.
 */
 
 #include <FastLED.h>
 #include <Wire.h>       // I2C library for RTC comms
 #include <MD_DS3231.h>
 #include "Chroniker.h"
+#include "Chroniker_Face.h"
+#include "Chroniker_FX.h"
+#include "Chroniker_Fade.h"
+#include "Chroniker_Gov.h"
+#include "Chroniker_Sync.h"
+#include "Chroniker_Journal.h"
+#include "Chroniker_Queue.h"
+#include "Chroniker_LDR.h"
+#include "Chroniker_Task.h"
+#include "Chroniker_Prof.h"
+#if REPLAY_TRACE
+#include "Chroniker_Replay.h"
+#endif
 #include "Chroniker_UI.h"
 #include "Chroniker_BT.h"
 #include "Chroniker_IR.h"
@@ -55,11 +219,70 @@ Note: Only required when debugging flag is turn on.
 static runState_e runState = RUN_INIT;
 static int8_t curDemo = -1;     // current demo number
 static uint8_t curClkFace = 0;  // current clock face
+#if BENCH_RENDER
+static bool bBenchRun = false;  // suppress hardware updates while benchmarking
+#endif
+static uint32_t showCount = 0;  // LED updates sent to the hardware
+static uint32_t showSkip = 0;   // LED updates suppressed as the frame is unchanged
+static uint32_t showDefer = 0;  // LED updates held back while an input was busy
+static uint32_t showForced = 0; // deferred LED updates sent after SHOW_MAX_DEFER
+static bool showPending = false;// a deferred LED update is waiting to be sent
+static uint32_t showHash = 0;   // hash of the last frame sent to the hardware
+static uint32_t timeDefer;      // millis() the pending LED update was first held back
+static uint8_t curBright = DEF_BRIGHTNESS;   // brightness setpoint for the clock pixels
+static enum { SET_IDLE, SET_HOUR, SET_MINUTE, SET_END } adjState = SET_IDLE; // time setup FSM
+static uint32_t adjTimeStart;   // time setup blink delay timer
+static bool adjBlink = false;   // time setup blink status
+static uint32_t timeSmooth = 0; // smooth clock face frame timer
+#if REPLAY_TRACE
+static bool rpArmed = false;    // the last replay event has taken effect, the next frame shows it
+static bool rpShown = false;    // a frame has been shown since the replay event took effect
+static uint32_t rpShowTime;     // micros() when the frame was shown
+static uint32_t rpShowHash;     // hash of the frame shown
+#endif
+static uint32_t timeTick = 0;   // millis() at the last RTC seconds tick
+#if PROFILE_DEBUG
+static uint32_t smoothTime = 0; // smooth face total render time (us)
+static uint16_t smoothFrames = 0; // smooth face frames rendered
+static uint16_t smoothMax = 0;  // smooth face longest render time (us)
+static uint16_t smoothOver = 0; // smooth face frames over SMOOTH_BUDGET
+#endif
+static uint16_t i2cCount = 0;   // RTC I2C transactions this second
+static uint16_t i2cRate = 0;    // RTC I2C transactions in the last second
+static bool bTick = false;      // the time has ticked and the clock face needs redrawing
+#if HW_USE_RTC_SQW
+static volatile uint8_t tickCount = 0; // seconds counted by the RTC SQW interrupt, not yet applied
+static uint8_t rtcResync = 0;   // seconds before the time is next read from the RTC
+#endif
+
+const uint8_t CLKFACE_SMOOTH = 3; // the smooth sweep face in clkFace[]
+const uint16_t SHOW_MAX_DEFER = 100; // max ms an LED update is held back for a busy input
+
+static_assert(SHOW_MAX_DEFER > IR_FRAME_TIME + IR_BUSY_TIME, "SHOW_MAX_DEFER must cover a whole IR frame");
 
 CRGB leds[NUM_LEDS];
-MD_CirQueue Q(CIR_QUEUE_SIZE, sizeof(cmdQ_t));
+uint8_t pix[NUM_LEDS];  // clock face pixel buffer - palette index and intensity
+Theme Themes;           // colour theme for the pixel buffer
+Crossfade Fade(leds, NUM_LEDS, FADE_PERIOD, FADE_TIME / FADE_PERIOD);  // display mode transitions
+FrameGovernor Gov(GOV_PERIOD_IDLE, GOV_PERIOD_BUSY, GOV_IDLE_TIME);  // animation frame rate for the input activity
+TimeSync Sync;          // time sync offset history and RTC drift calibration
+SettingsJournal Journal; // brightness, clock face and demo saved in EEPROM
+
+static_assert(FADE_TIME / FADE_PERIOD <= 255, "Too many crossfade steps");
+
+// Command rings, one for each input
+CmdRing<UI_QUEUE_SIZE> QUI;
+#if HW_USE_BLUETOOTH
+CmdRing<CMD_QUEUE_SIZE> QBT;
+#endif
+#if HW_USE_IR
+CmdRing<CMD_QUEUE_SIZE> QIR;
+#endif
 
 UISwitch UI(MODE_SWITCH_PIN, MODE_SWITCH_ACTIVE);
+#if USE_LDR_SENSOR
+LDRSensor LDR(LDR_SENSOR);
+#endif
 #if HW_USE_BLUETOOTH
 BTSerial BT(BT_RECV_PIN, BT_SEND_PIN, BT_NAME);
 #endif
@@ -69,6 +292,46 @@ IRemote IR(IR_RECV_PIN);
 
 void(*hwReset) (void) = 0; //declare reset function @ address 0
 
+// Task table - order of the entries must match the taskId_e values
+enum taskId_e { TASK_INPUT, TASK_DISPLAY, TASK_LAMPTEST, TASK_SWITCH, TASK_NOTIFY, TASK_REPLAY };
+
+const uint16_t LAMPTEST_DELAY = 30; // ms between lamp test steps
+const uint16_t SWITCH_CHECK = 50;   // ms between checks for power up switch release
+
+void taskInput(void);
+void taskDisplay(void);
+void taskLampTest(void);
+void taskSwitchWait(void);
+void taskNotify(void);
+#if REPLAY_TRACE
+void taskReplay(void);
+#endif
+
+task_t taskTable[] =
+{
+  { taskInput, 0, true },   // poll inputs and process commands
+  { taskDisplay, 0, true }, // display FSM
+  { taskLampTest, LAMPTEST_DELAY, false }, // lamp test steps
+  { taskSwitchWait, SWITCH_CHECK, false }, // power up switch release
+  { taskNotify, STATE_NOTIFY_PERIOD, false }, // BT state change notifications
+#if REPLAY_TRACE
+  { taskReplay, 0, false },   // input trace replay
+#endif
+};
+
+TaskScheduler Tasks(taskTable, ARRAY_SIZE(taskTable));
+
+#if PROFILE_LOOP
+Profiler Prof;
+static uint32_t loopCount = 0;  // passes through loop()
+static uint32_t timeLoop = 0;   // start of the current pass through loop()
+#define PROF_START(t)   uint32_t t = Prof.start()
+#define PROF_STOP(s, t) Prof.stop(s, t)
+#else
+#define PROF_START(t)
+#define PROF_STOP(s, t)
+#endif
+
 // -------------------------------------
 // Utility functions
 
@@ -79,6 +342,96 @@ void clearAll(void)
     leds[i] = COL_OFF;
 }
 
+uint32_t hashFrame(void)
+// Fletcher style checksum of the frame shown and brightness setting.
+// Only uses additions so it is cheap to run on every update.
+{
+  uint8_t *p = (uint8_t *)Fade.getFrame();
+  uint16_t s1 = FastLED.getBrightness();
+  uint16_t s2 = s1;
+
+  for (uint16_t i = 0; i < sizeof(leds); i++)
+  {
+    s1 += *p++;
+    s2 += s1;
+  }
+
+  return(((uint32_t)s2 << 16) | s1);
+}
+
+bool inputBusy(void)
+// Returns true if any interrupt driven input is receiving data
+{
+#if HW_USE_BLUETOOTH
+  if (BT.isBusy()) return(true);
+#endif
+#if HW_USE_IR
+  if (IR.isBusy()) return(true);
+#endif
+  return(false);
+}
+
+void updateDisplay(void)
+// Send the leds[] data to the hardware.
+// All LED updates should be done through here.
+// FastLED.show() blocks interrupts while it runs, so it is only 
+// called if the frame is different from the last one shown, and is
+// held back while input is being received (for up to SHOW_MAX_DEFER).
+// Held back frames are sent later by serviceDisplay().
+{
+  uint32_t hash;
+
+#if BENCH_RENDER
+  if (bBenchRun) return;
+#endif
+
+  hash = hashFrame();
+  if (hash == showHash && showCount != 0)
+  {
+    showSkip++;
+    showPending = false;  // hardware already shows this
+    return;
+  }
+
+  if (inputBusy())
+  {
+    if (!showPending)
+    {
+      showPending = true;
+      showDefer++;
+      timeDefer = millis();
+    }
+    if (millis() - timeDefer < SHOW_MAX_DEFER)
+      return;
+    showForced++;
+  }
+
+  showPending = false;
+  showHash = hash;
+  showCount++;
+  {
+    PROF_START(timeShow);
+    FastLED.show();
+    PROF_STOP(PROF_SHOW, timeShow);
+  }
+#if REPLAY_TRACE
+  if (rpArmed && !rpShown)
+  {
+    rpShown = true;
+    rpShowTime = micros();
+    rpShowHash = hash;
+  }
+#endif
+}
+
+void serviceDisplay(void)
+// Send any held back LED update once the inputs allow it.
+// Call every time through loop().
+{
+  if (showPending)
+    updateDisplay();
+}
+
 void displayTime()
 {
 #if DEBUG
@@ -90,138 +443,440 @@ void displayTime()
 }
 
 void setBrightness(int16_t delta = 0, boolean newValue = false)
+// Change the brightness setting by delta, or set it to delta if newValue,
+// and set the LED brightness for the setting and ambient light.
 {
-  static uint8_t curBright = DEF_BRIGHTNESS;   // brightness setpoint for the clock pixels
-  uint8_t ambient = 0;        // ambient value
+  int16_t v;
 
-  //  PRINT("\nsetBright @", curBright);
-  //  PRINT(" delta:", delta);
+  v = (newValue ? 0 : curBright) + delta;
+  curBright = constrain(v, 0, 255);
 
 #if USE_LDR_SENSOR
-  // check what ambient adjustment is needed
-  ambient = analogRead(LDR_SENSOR) / 8;   // map 1024 to smaller number
+  // take off the ambient adjustment
+  v = curBright - LDR.getAmbient();
+  if (v < 0) v = 0;
+#else
+  v = curBright;
 #endif
-  //  PRINT(" ambient:", ambient);
-
-  if (newValue) // just set the new value
-    curBright = delta;
-  else if (delta > 0) // work out the adjusted delta now
-  {
-    if (curBright + delta - ambient > MAX_BRIGHTNESS)
-      curBright = MAX_BRIGHTNESS;
-    else
-      curBright += delta;
-  }
-  else
-  {
-    if (curBright + delta - ambient < MIN_BRIGHTNESS)
-      curBright = MIN_BRIGHTNESS;
-    else
-      curBright += delta; // delta already -ve
-  }
-  //  PRINT("  new setting:", curBright - ambient);
 
-  // finally set the brightness inthe hardware
-  FastLED.setBrightness(curBright - ambient);
+  // finally set the brightness in the hardware
+  FastLED.setBrightness(pgm_read_byte(&brightLUT::data[v]));
 }
 
 // -------------------------------------
 // Clock update and display
 
-void showClock(bool bOnH = true, bool bOnM = true, bool bOnS = true)
+void drawLevel(uint8_t i, uint8_t pal, uint8_t level)
+// Draw part of an anti-aliased hand at intensity level (0-15). It only 
+// replaces what is under it from half intensity up, or if the pixel is off.
 {
-  typedef struct 
-  { 
-    uint8_t x; 
-    CRGB::HTMLColorCode col; 
-  } tuple;
-
-  #define swap(a, b) {tuple t; t=a; a=b; b=t; }
+  if (level != 0 && (level >= 8 || (pix[i] & 0x0f) == PAL_OFF))
+    pix[i] = pixel(pal, level);
+}
 
-  tuple cx[3] = { 0 };
+void drawSmooth(const clkHands_t &h, uint16_t unit, uint8_t pal)
+// Draw a hand at 8.8 fixed point dial position unit on the ring, 
+// splitting its intensity between the LED at the integer position 
+// and the next one
+{
+  uint16_t pos = ((uint32_t)unit * h.ring.scale) >> 16;  // 8.8 LED position on the ring
+  uint8_t i = h.ring.first + (pos >> 8);
+  uint8_t f = pos & 0xff;
 
-  displayTime();
+  if (pal == PAL_OFF) return;   // blinked off
 
-  clearAll();
+  drawLevel(i, pal, (255 - f) >> 4);
+  drawLevel((i + 1 == h.ring.first + h.ring.count) ? h.ring.first : i + 1, pal, f >> 4);
+}
 
-  // set up the pixel indices for the h[0], m[1], s[2] 
-  cx[0].x = (RTC.h * (NUM_LEDS / 12)) + (RTC.m / (NUM_LEDS / 5));
-  cx[0].col = (bOnH ? COL_HHAND : COL_OFF);
-  cx[1].x = RTC.m;
-  cx[1].col = (bOnM ? COL_MHAND : COL_OFF);
-  cx[2].x = RTC.s;
-  cx[2].col = (bOnS ? COL_SHAND : COL_OFF);
+// Hand rendering kernels for the clock faces
+void drawDots(const clkHands_t &h, const uint8_t *layer)
+// Each hand is a single pixel
+{
+  for (uint8_t i = 0; i < HAND_COUNT; i++)
+    if (h.ring.show & (1 << layer[i]))
+      pix[h.x[layer[i]]] = pixel(h.pal[layer[i]]);
+}
 
-  // now draw the clock face depending on what is currently selected
-  switch (curClkFace)
-  {
-  case 0: // standard analog clock face
-  case 1: // minmalist clock face (hms dots only)
+void drawSweep(const clkHands_t &h, const uint8_t *layer)
+// Second (and minute) hands sweep smoothly between pixels
+{
+  for (uint8_t i = 0; i < HAND_COUNT; i++)
   {
-    if (curClkFace == 0)  // put in the hour marks
+    if (!(h.ring.show & (1 << layer[i])))
+      continue;
+
+    switch (layer[i])
     {
-      // Set default 'mark' colours for the whole wheel
-      for (uint8_t i = 0; i < NUM_LEDS; i++)
-        leds[i] = COL_MMARK;
-      for (uint8_t i = 0; i < NUM_LEDS; i += (NUM_LEDS / 12))
-        leds[i] = (i == 0 ? COL_12HMARK : COL_HMARK);
+    case HAND_S:
+      drawSmooth(h, h.unit[HAND_S], h.pal[HAND_S]);
+      break;
+
+    case HAND_M:
+      if (SMOOTH_MHAND)
+        drawSmooth(h, h.unit[HAND_M], h.pal[HAND_M]);
+      else
+        pix[h.x[HAND_M]] = pixel(h.pal[HAND_M]);
+      break;
+
+    default:
+      pix[h.x[layer[i]]] = pixel(h.pal[layer[i]]);
+      break;
     }
+  }
+}
+
+void drawPie(const clkHands_t &h, const uint8_t *layer)
+// Fill segments of the ring between the hands on the ring
+{
+  uint8_t idx[HAND_COUNT];
+  uint8_t n = 0;
+  uint8_t i = h.ring.first;
+
+  // sort the hands on the ring in increasing order
+  for (uint8_t j = 0; j < HAND_COUNT; j++)
+  {
+    uint8_t k;
 
-    // Now set the 'hand' colours. Colour viewing priority is
-    // hour, minute, and then seconds, so update hands in reverse sequence
-    leds[cx[2].x] = cx[2].col;
-    leds[cx[1].x] = cx[1].col;
-    leds[cx[0].x] = cx[0].col;
+    if (!(h.ring.show & (1 << j)))
+      continue;
+    for (k = n++; k > 0 && h.x[idx[k - 1]] > h.x[j]; k--)
+      idx[k] = idx[k - 1];
+    idx[k] = j;
   }
-  break;
 
-  case 2: // 'pie chart' face
+  // now draw in the colours
+  for (uint8_t j = 0; j < n; j++)
+    while (i <= h.x[idx[j]]) pix[i++] = pixel(h.pal[idx[j]]);
+}
+
+// Clock face table - CLKFACE_SMOOTH must be the index of the sweep face
+// and CLKFACE_COUNT (Chroniker.h) the number of faces
+const clkFace_t PROGMEM clkFace[] =
+{
+  { bgHourMarks::data, drawDots, { HAND_S, HAND_M, HAND_H } },  // standard analog clock face
+  { nullptr, drawDots, { HAND_S, HAND_M, HAND_H } },            // minimalist clock face (hms dots only)
+  { nullptr, drawPie, { HAND_S, HAND_M, HAND_H } },             // 'pie chart' face
+  { bgHourMarks::data, drawSweep, { HAND_S, HAND_M, HAND_H } }, // smooth sweep face
+};
+
+static_assert(ARRAY_SIZE(clkFace) == CLKFACE_COUNT, "CLKFACE_COUNT must match clkFace[]");
+
+void renderClock(bool bOnH = true, bool bOnM = true, bool bOnS = true)
+// Render the current clock face into pix[] for the time in RTC
+{
+  clkFace_t f;
+  clkHands_t h;
+  uint32_t elapsed = millis() - timeTick;
+  uint8_t hour = RTC.h;
+  uint8_t frac;
+
+  memcpy_P(&f, &clkFace[curClkFace], sizeof(f));
+
+  // copy in the background layer
+  if (f.bg == nullptr)
+    memset(pix, pixel(PAL_OFF), sizeof(pix));
+  else
+    memcpy_P(pix, f.bg, sizeof(pix));
+
+  // set up the dial positions and colours for the hands
+  // RTC is in 12H mode so hours run 1-12; 12 needs to be at the top
+  if (hour >= 12) hour -= 12;
+  h.unit[HAND_H] = ((uint16_t)(hour * 5) << 8) + (((uint32_t)RTC.m * 1365) >> 6);  // m/12 units = m * 1365/64 in 8.8
+  h.pal[HAND_H] = (bOnH ? PAL_HHAND : PAL_OFF);
+  h.pal[HAND_M] = (bOnM ? PAL_MHAND : PAL_OFF);
+  h.pal[HAND_S] = (bOnS ? PAL_SHAND : PAL_OFF);
+
+  // 256/1000 ~= 131/512 to avoid a division; hold at the end 
+  // of the second if the next tick is late
+  frac = (elapsed >= 1000) ? 255 : (elapsed * 131) >> 9;
+  h.unit[HAND_S] = ((uint16_t)RTC.s << 8) + frac;
+  // minute moves 1/60 unit each second (1/60 ~= 1092/65536)
+  h.unit[HAND_M] = ((uint16_t)RTC.m << 8) + (((uint32_t)h.unit[HAND_S] * 1092) >> 16);
+
+  // now draw the hands on each ring
+  for (uint8_t r = 0; r < RING_COUNT; r++)
   {
-    // sort the h, m, s in increasing order
-    if (cx[0].x > cx[1].x) swap(cx[0], cx[1]);
-    if (cx[0].x > cx[2].x) swap(cx[0], cx[2]);
-    if (cx[1].x > cx[2].x) swap(cx[1], cx[2]);
+    const uint8_t *pos = &ringLUT::pos[r * DIAL_UNITS];
 
-    // now draw in the colours
-    {
-      uint8_t i = 0;
+    memcpy_P(&h.ring, &ringGeomLUT::data[r], sizeof(h.ring));
+    if ((h.ring.show & RING_HMS) == 0)
+      continue;
 
-      while (i <= cx[0].x) leds[i++] = cx[0].col;
-      while (i <= cx[1].x) leds[i++] = cx[1].col;
-      while (i <= cx[2].x) leds[i++] = cx[2].col;
-    }
+    h.x[HAND_H] = pgm_read_byte(&pos[hour * 5]) + pgm_read_byte(&ringLUT::creep[(r * DIAL_UNITS) + RTC.m]);
+    h.x[HAND_M] = pgm_read_byte(&pos[RTC.m]);
+    h.x[HAND_S] = pgm_read_byte(&pos[RTC.s]);
+
+    f.draw(h, f.layer);
   }
-  break;
+}
 
-  default:
-    curClkFace = 0;   // gone too far - reset this variable
+void showClock(bool bOnH = true, bool bOnM = true, bool bOnS = true)
+{
+#if PROFILE_DEBUG
+  if (curClkFace == CLKFACE_SMOOTH)
+  {
+    uint32_t t = micros();
+
+    renderClock(bOnH, bOnM, bOnS);
+    t = micros() - t;
+
+    smoothTime += t;
+    smoothFrames++;
+    if (t > smoothMax) smoothMax = t;
+    if (t > SMOOTH_BUDGET) smoothOver++;
   }
+  else
+#endif
+    renderClock(bOnH, bOnM, bOnS);
 
   // update the hardware
+  Themes.expand(pix, leds, NUM_LEDS);
   setBrightness();
-  FastLED.show();
+  updateDisplay();
 }
 
-void cbClock(void)
-// Only execute callback when we are in simple display mode
+void showTheme(void)
+// Show the current clock face frame in the new theme colours.
+// Only the palette has changed, so the frame is not redrawn.
+{
+  if (runState != RUN_NORMAL && runState != RUN_SETUP)
+    return;
+
+  Themes.expand(pix, leds, NUM_LEDS);
+  updateDisplay();
+}
+
+#if HW_USE_RTC_SQW
+void isrTick(void)
+// RTC SQW 1Hz interrupt - the seconds register changes on the falling edge
+{
+  if (tickCount < 0xff) tickCount++;
+}
+
+void advanceTime(void)
+// Move the RTC time fields on by one second, 12H mode (hours 1-12)
+{
+  if (++RTC.s < 60) return;
+  RTC.s = 0;
+  if (++RTC.m < 60) return;
+  RTC.m = 0;
+  RTC.h = (RTC.h % 12) + 1;
+  if (RTC.h == 12) RTC.pm = !RTC.pm;   // 11:59:59 rolls over to the other half day
+}
+#endif
+
+void readRTC(void)
+// Read the time from the RTC
 {
   RTC.readTime();
+  i2cCount++;
+}
+
+void writeRTC(void)
+// Write the time fields to the RTC
+{
+  RTC.writeTime();
+  i2cCount++;
+#if HW_USE_RTC_SQW
+  rtcResync = 0;  // make sure we read it back on the next tick
+#endif
+}
+
+void setTime24(uint8_t h, uint8_t m, uint8_t s)
+// Set the RTC time fields from a 24 hour time, the RTC runs in 12H mode
+{
+  RTC.h = (h % 12 == 0) ? 12 : h % 12;
+  RTC.pm = (h >= 12);
+  RTC.m = m;
+  RTC.s = s;
+}
+
+int32_t clockMs(void)
+// Time on the 12 hour dial in ms - the RTC time plus the ms since the last tick
+{
+  uint32_t ms = millis() - timeTick;
+
+  if (ms > 999) ms = 999;
+  return(((((RTC.h % 12) * 60L) + RTC.m) * 60 + RTC.s) * 1000 + ms);
+}
+
+static bool bSyncDue = false;   // a synchronised time is waiting to be written
+static uint32_t syncDue;        // millis() of the second boundary to write it
+static uint32_t syncSecond;     // second of the day to write
+
+void syncReply(int32_t offset, char status)
+// Return the result of a time sync to the BT master. This is the only
+// answer to the sync apart from its ACK, so a refused sync is reported
+// here rather than with a second ACK.
+{
+#if HW_USE_BLUETOOTH
+  struct
+  {
+    int32_t offset;   // RTC time less the synchronised time (ms)
+    int8_t aging;     // DS3231 aging offset
+    char status;      // PKT_ERR_OK, or PKT_ERR_BUSY if the offset could not be measured
+  } d = { offset, Sync.getAging(), status };
+
+  BT.sendData(CMD_SYNC, 0, &d, sizeof(d));
+#endif
+}
+
+void timeSync(uint32_t ms)
+// Record the RTC offset from the synchronised time of day (ms) and set the
+// RTC on the next whole second. The aging offset is updated from the drift.
+// The offset and aging offset are returned to the BT master.
+{
+  int32_t offset;
+
+  // the time fields are only current outside setup and within a second of the tick
+  if (runState == RUN_SETUP || millis() - timeTick >= 1000)
+  {
+    syncReply(0, PKT_ERR_BUSY);
+    return;
+  }
+
+  offset = clockMs() - (int32_t)(ms % SYNC_DAY);
+
+  // nearest way round the dial
+  if (offset > SYNC_DAY / 2)
+    offset -= SYNC_DAY;
+  else if (offset < -SYNC_DAY / 2)
+    offset += SYNC_DAY;
+
+  if (Sync.add(offset))
+  {
+    RTC.control(DS3231_AGING_OFFSET, (uint8_t)Sync.getAging());
+    RTC.control(DS3231_TCONV, DS3231_ON);   // a conversion applies the new aging offset
+    i2cCount += 2;
+  }
+
+  syncSecond = (ms + 999) / 1000;
+  syncDue = millis() + (syncSecond * 1000) - ms;
+  bSyncDue = true;
+  syncReply(offset, PKT_ERR_OK);
+}
+
+void syncWrite(void)
+// Write the synchronised time to the RTC once the second boundary is due.
+// Writing the seconds restarts the RTC countdown, so it ticks from now.
+{
+  if (!bSyncDue || (int32_t)(millis() - syncDue) < 0)
+    return;
+
+  bSyncDue = false;
+  setTime24((syncSecond / 3600) % 24, (syncSecond / 60) % 60, syncSecond % 60);
+  writeRTC();
+  timeTick = millis();
+}
+
+void timeManual(void)
+// The time has been set by hand - drop any sync waiting to be written
+// and start the drift measurement again
+{
+  bSyncDue = false;
+  Sync.manual();
+}
+
+void cbClock(void)
+// RTC seconds tick - bring the time fields up to date
+{
+#if HW_USE_RTC_SQW
+  if (rtcResync == 0)
+  {
+    readRTC();
+    rtcResync = RTC_RESYNC_TIME;
+  }
+  else
+    advanceTime();
+  rtcResync--;
+#else
+  readRTC();
+#endif
+  i2cRate = i2cCount;
+  i2cCount = 0;
+  timeTick = millis();
+  bTick = true;
+}
+
+void runTime(void)
+// Apply the RTC seconds ticks in every run state, so the time fields are
+// current whatever is being shown. Setup edits the time fields directly 
+// and writes them to the RTC at the end, so the ticks wait until then.
+{
+  if (runState == RUN_SETUP)
+    return;
+
+#if HW_USE_RTC_SQW
+  uint8_t n;
+
+  noInterrupts();
+  n = tickCount;
+  tickCount = 0;
+  interrupts();
+
+  if (n == 0)
+    return;
+  if (n > 1) rtcResync = 0;   // ticks were missed, read the time back
+  cbClock();
+#else
+  RTC.checkAlarm1();  // callback will do the work of updates
+  i2cCount++;
+#endif
+}
+
+void showTick(void)
+// Redraw the clock face for a new second
+{
+  displayTime();
   showClock();
+  if (RTC.s == 0)
+  {
+    PRINT("\nShow sent:", showCount);
+    PRINT(" skipped:", showSkip);
+    PRINT(" deferred:", showDefer);
+    PRINT(" forced:", showForced);
+    PRINT("\nI2C/s:", i2cRate);
+    PRINT("\nQ dropped:", QUI.getDropped());
+#if HW_USE_BLUETOOTH
+    PRINT(" ", QBT.getDropped());
+#endif
+#if HW_USE_IR
+    PRINT(" ", QIR.getDropped());
+#endif
+#if HW_USE_BLUETOOTH
+    PRINT("\nBT TX high water:", BT.getTxHighWater());
+    PRINT(" overflow:", BT.getTxOverflow());
+    PRINT(" RX overflow:", BT.getRxOverflow());
+    PRINT(" dropped:", BT.getRxDropped());
+    PRINTS("\nBT AT:");
+    for (uint8_t i = 0; i < BT.getATCount(); i++)
+      PRINT(" ", BT.getATResult(i));
+#endif
+#if PROFILE_DEBUG
+    if (smoothFrames != 0)
+    {
+      PRINT("\nSmooth frames:", smoothFrames);
+      PRINT(" avg us:", smoothTime / smoothFrames);
+      PRINT(" max us:", smoothMax);
+      PRINT(" over budget:", smoothOver);
+      smoothTime = smoothFrames = smoothMax = smoothOver = 0;
+    }
+#endif
+    Tasks.report();
+    Gov.report();
+  }
 }
 
 boolean adjustTime(uint8_t cmd, uint8_t data)
 // return true when adjustment cycle completed
 {
-  static enum { SET_IDLE, SET_HOUR, SET_MINUTE, SET_END } adjState = SET_IDLE;
-  static uint32_t timeStart;  // tracking blink delay time
-  static bool bBlink = false; // toggle for blink status
-
   // run the FSM for setup
   switch (adjState)
   {
   case SET_IDLE:     // idle
     PRINTS("\nSET_IDLE");
-    timeStart = millis();
+    adjTimeStart = millis();
     adjState = SET_HOUR;
     break;
 
@@ -246,7 +901,7 @@ boolean adjustTime(uint8_t cmd, uint8_t data)
           RTC.h--;
         break;
       }
-      showClock(bBlink, true, true);
+      showClock(adjBlink, true, true);
       break;
     }
     break;
@@ -273,7 +928,7 @@ boolean adjustTime(uint8_t cmd, uint8_t data)
           RTC.m--;
         break;
       }
-      showClock(true, bBlink, true);
+      showClock(true, adjBlink, true);
       break;
     }
     break;
@@ -281,68 +936,83 @@ boolean adjustTime(uint8_t cmd, uint8_t data)
   case SET_END:   // update clock and exit
     PRINTS("\nSET_END");
     RTC.s = 0;
-    RTC.writeTime();
+    writeRTC();
+    timeManual();
     adjState = SET_IDLE;
     break;
   }
 
   // toggle the blink status with the required delay
-  if (millis() - timeStart >= BLINK_DELAY)
+  if (millis() - adjTimeStart >= BLINK_DELAY)
   {
-    bBlink = !bBlink;
-    timeStart = millis();
+    adjBlink = !adjBlink;
+    adjTimeStart = millis();
 
     switch (adjState)
     {
-    case SET_HOUR:   showClock(bBlink, true, true); break;
-    case SET_MINUTE: showClock(true, bBlink, true); break;
+    case SET_HOUR:   showClock(adjBlink, true, true); break;
+    case SET_MINUTE: showClock(true, adjBlink, true); break;
     }
   }
 
   return(adjState == SET_IDLE);
 }
 
-void lampTest(void)
-// Do a lamp test
-// Blocking until the test is completed
-{
-  const CRGB::HTMLColorCode colCycle[] = {CRGB::Red, CRGB::Green, CRGB::Blue, CRGB::White};
+static uint16_t lampStep = 0;  // lamp test step: colour * NUM_LEDS + pixel
 
+void startLampTest(void)
+// Start the lamp test task, which runs until done or another command
+{
   FastLED.setBrightness(200);   // pick something bright
 
   // Clear the display
-  for (uint8_t i = 0; i < NUM_LEDS; i++)
-    leds[i] = CRGB::Black;
-  FastLED.show();
+  clearAll();
+  updateDisplay();
+
+  lampStep = 0;
+  runState = RUN_LAMPTEST;
+  Tasks.start(TASK_LAMPTEST, LAMPTEST_DELAY);
+}
+
+void stopLampTest(void)
+// Stop the lamp test and go back to the clock
+{
+  Tasks.stop(TASK_LAMPTEST);
+  runState = RUN_INIT;
+}
 
-  // cycle through the colours, one per sector
-  for (uint8_t c = 0; c < ARRAY_SIZE(colCycle); c++)
+void taskLampTest(void)
+// Do the next lamp test step - one pixel at a time 
+// through each colour for the whole ring
+{
+  const CRGB::HTMLColorCode colCycle[] = {CRGB::Red, CRGB::Green, CRGB::Blue, CRGB::White};
+
+  if (lampStep >= ARRAY_SIZE(colCycle) * NUM_LEDS)
   {
-    for (uint8_t i = 0; i < NUM_LEDS; i++)
-    {
-      leds[i] = colCycle[c];
-      FastLED.show();
-      delay(30);
-    }
+    stopLampTest();
+    return;
   }
+
+  leds[lampStep % NUM_LEDS] = colCycle[lampStep / NUM_LEDS];
+  updateDisplay();
+  lampStep++;
 }
 
 // -------------------------------------
 // Demo code
 // Taken from the FastLED examples folder and adapted to run
-// properly here
+// properly here. The beats run on the effect time and the random
+// numbers are seeded at the start, so the frames do not depend on
+// when the scheduler gets to run them.
 
-#if HW_USE_IR   // if IR used slow down the FastLED updates as they block interrupts
-#define FRAMES_PER_SECOND 12
-#else
-#define FRAMES_PER_SECOND 25
-#endif
-#define ANIMATION_DELAY (1000/FRAMES_PER_SECOND)
+const uint16_t DEMO_SEED = 1337;   // random number seed at the start of each demo
 
-static uint32_t timeStart = 0;
 static uint32_t timeHue = 0;
 static uint8_t hue = 0;
 static int16_t idx = 0;
+static uint8_t state = 0;
+
+FXScheduler FX(GOV_PERIOD_IDLE);
 
 void fadeall(void) 
 { 
@@ -350,51 +1020,56 @@ void fadeall(void)
     leds[i].nscale8(250); 
 }
 
+uint16_t demoBeat16(uint8_t bpm)
+// FastLED beat16() on the effect time instead of millis()
+{
+  return((FX.elapsed() * ((uint16_t)bpm << 8) * 280) >> 16);
+}
+
+uint8_t demoBeatsin8(uint8_t bpm, uint8_t lo, uint8_t hi)
+// FastLED beatsin8() on the effect time
+{
+  return(lo + scale8(sin8(demoBeat16(bpm) >> 8), hi - lo));
+}
+
+uint16_t demoBeatsin16(uint8_t bpm, uint16_t lo, uint16_t hi)
+// FastLED beatsin16() on the effect time
+{
+  return(lo + scale16(sin16(demoBeat16(bpm)) + 32768, hi - lo));
+}
+
 void initDemo(void)
 {
   clearAll();
-  timeStart = timeHue = millis();
-  idx = hue = 0;
+  random16_set_seed(DEMO_SEED);
+  timeHue = FX.time();
+  idx = hue = state = 0;
 }
 
 void updateHue(void)
+// advance the hue every 20ms of effect time
 {
-  if (millis() - timeHue >= 20)
+  while (FX.time() - timeHue >= 20)
   {
     hue++;
-    timeHue = millis();
+    timeHue += 20;
   }
 }
 
-void demoCylon(bool bInit)
+void demoCylon(void)
 {
-  static uint8_t state = 0;
-  static int16_t idx = 0;
-
-  if (bInit)
-  {
-    initDemo();
-    state = 0;
-  }
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-
   switch (state)
   {
     case 0: // First slide the led in one direction
-      timeStart = millis();
       leds[idx++] = CHSV(hue++, 255, 255); // Set the i'th led to red 
-      FastLED.show();       // Show the leds
       fadeall();
       if (idx == NUM_LEDS) state = 1;
       break;
 
     case 1: // Now go in the other direction.  
       leds[--idx] = CHSV(hue++, 255, 255);     // Set the i'th led to red 
-      FastLED.show();     // Show the leds
       fadeall();
-      if (idx < 0) state = 0;
+      if (idx == 0) state = 0;
       break;
 
     default:
@@ -403,108 +1078,367 @@ void demoCylon(bool bInit)
   }
 }
 
-void demoRainbow(bool bInit)
+void demoRainbow(void)
 {
-  if (bInit) initDemo();
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-  timeStart = millis();
-
   // FastLED's built-in rainbow generator
   fill_rainbow(leds, NUM_LEDS, hue, 7);
   updateHue();
-  FastLED.show();
 }
 
-void demoRainbowWithGlitter(bool bInit)
+void demoRainbowWithGlitter(void)
 {
-  if (bInit) initDemo();
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-  timeStart = millis();
-
   // built-in FastLED rainbow, plus some random sparkly glitter
   fill_rainbow(leds, NUM_LEDS, hue, 7);
   if (random8() < 80)
     leds[random16(NUM_LEDS)] += CRGB::White;
-  FastLED.show();
 }
 
-void demoConfetti(bool bInit)
+void demoConfetti(void)
 {
-  if (bInit) initDemo();
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-  timeStart = millis();
-
   // random colored speckles that blink in and fade smoothly
   fadeToBlackBy(leds, NUM_LEDS, 10);
   int pos = random16(NUM_LEDS);
   leds[pos] += CHSV(hue + random8(64), 200, 255);
-  FastLED.show();
 }
 
-void demoSinelon(bool bInit)
+void demoSinelon(void)
 {
-  if (bInit) initDemo();
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-  timeStart = millis();
-
   // a colored dot sweeping back and forth, with fading trails
   fadeToBlackBy(leds, NUM_LEDS, 20);
-  int pos = beatsin16(13, 0, NUM_LEDS);
+  int pos = demoBeatsin16(13, 0, NUM_LEDS - 1);
   leds[pos] += CHSV(hue, 255, 192);
   updateHue();
-  FastLED.show();
 }
 
-void demoBPM(bool bInit)
+void demoBPM(void)
 {
   const uint8_t BeatsPerMinute = 62;
   const CRGBPalette16 palette = PartyColors_p;
 
-  if (bInit) initDemo();
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-  timeStart = millis();
-
   // colored stripes pulsing at a defined Beats-Per-Minute (BPM)
-  uint8_t beat = beatsin8(BeatsPerMinute, 64, 255);
+  uint8_t beat = demoBeatsin8(BeatsPerMinute, 64, 255);
 
   for (int i = 0; i < NUM_LEDS; i++)
     leds[i] = ColorFromPalette(palette, hue + (i * 2), beat - hue + (i * 10));
   updateHue();
-  FastLED.show();
 }
 
-void demoJuggle(bool bInit) 
+void demoJuggle(void) 
 {
   byte dothue = 0;
 
-  if (bInit) initDemo();
-
-  if (millis() - timeStart < ANIMATION_DELAY)
-    return;
-  timeStart = millis();
-
   // eight colored dots, weaving in and out of sync with each other
   fadeToBlackBy(leds, NUM_LEDS, 20);
   for (int i = 0; i < 8; i++) 
   {
-    leds[beatsin16(i + 7, 0, NUM_LEDS)] |= CHSV(dothue, 200, 255);
+    leds[demoBeatsin16(i + 7, 0, NUM_LEDS - 1)] |= CHSV(dothue, 200, 255);
     dothue += 32;
   }
-  FastLED.show();
 }
 
+// Demo effect table - init, step, teardown
+const fxEffect_t PROGMEM demoFX[] =
+{
+  { initDemo, demoCylon, nullptr },
+  { initDemo, demoRainbow, nullptr },
+  { initDemo, demoRainbowWithGlitter, nullptr },
+  { initDemo, demoConfetti, nullptr },
+  { initDemo, demoSinelon, nullptr },
+  { initDemo, demoBPM, nullptr },
+  { initDemo, demoJuggle, nullptr },
+};
+
+#if BENCH_RENDER
+// -------------------------------------
+// Render benchmark
+// Times the render paths with the hardware update suppressed.
+// AVR has no instruction counter, so CPU cycles are derived from 
+// the elapsed time.
+
+const uint16_t BENCH_DEMO_FRAMES = 1000;  // frames rendered for each demo
+
+typedef struct
+{
+  uint32_t frames;    // number of frames rendered
+  uint32_t timeTotal; // total render time (us)
+  uint32_t timeMax;   // slowest frame (us)
+  uint32_t bytes;     // total LED bytes changed by all frames
+} benchStats_t;
+
+static CRGB benchPrev[NUM_LEDS];  // previous frame, to count bytes changed
+
+void benchFrame(benchStats_t &bs, uint32_t timeFrame)
+// Accumulate the statistics for the frame just rendered into leds[]
+{
+  bs.frames++;
+  bs.timeTotal += timeFrame;
+  if (timeFrame > bs.timeMax) bs.timeMax = timeFrame;
+
+  for (uint8_t i = 0; i < NUM_LEDS; i++)
+  {
+    for (uint8_t j = 0; j < 3; j++)
+      if (leds[i].raw[j] != benchPrev[i].raw[j]) bs.bytes++;
+    benchPrev[i] = leds[i];
+  }
+}
+
+void benchReport(char type, uint8_t n, benchStats_t &bs)
+// Print the results for one benchmark run
+{
+  uint32_t avg = bs.timeTotal / bs.frames;
+
+  Serial.print(F("\n"));
+  Serial.print(type);
+  Serial.print(n);
+  Serial.print(F(" frames:"));  Serial.print(bs.frames);
+  Serial.print(F(" avg:"));     Serial.print(avg);
+  Serial.print(F("us/"));       Serial.print(avg * clockCyclesPerMicrosecond());
+  Serial.print(F("cyc max:"));  Serial.print(bs.timeMax);
+  Serial.print(F("us/"));       Serial.print(bs.timeMax * clockCyclesPerMicrosecond());
+  Serial.print(F("cyc bytes/frame:")); Serial.print(bs.bytes / bs.frames);
+}
+
+void benchClock(uint8_t face, bool bBlink)
+// Render every time of day on the specified face.
+// If bBlink is set then alternate frames blink the hour and 
+// minute hands, the same as the redraws done by adjustTime().
+{
+  benchStats_t bs = { 0 };
+  uint32_t timeFrame;
+
+  curClkFace = face;
+  for (RTC.h = 1; RTC.h <= 12; RTC.h++)
+    for (RTC.m = 0; RTC.m < 60; RTC.m++)
+      for (RTC.s = 0; RTC.s < 60; RTC.s++)
+      {
+        bool bOn = !bBlink || (RTC.s & 1);
+
+        timeFrame = micros();
+        renderClock(bOn, bOn, true);
+        Themes.expand(pix, leds, NUM_LEDS);
+        timeFrame = micros() - timeFrame;
+        benchFrame(bs, timeFrame);
+      }
+
+  benchReport(bBlink ? 'A' : 'F', face, bs);
+}
+
+void benchDemo(uint8_t n)
+// Render a fixed number of frames of the specified demo
+{
+  benchStats_t bs = { 0 };
+  uint32_t timeFrame;
+
+  FX.start(&demoFX[n]);
+  for (uint16_t i = 0; i < BENCH_DEMO_FRAMES; i++)
+  {
+    timeFrame = micros();
+    FX.step();
+    timeFrame = micros() - timeFrame;
+    benchFrame(bs, timeFrame);
+  }
+  FX.stop();
+
+  benchReport('D', n, bs);
+}
+
+void benchRender(void)
+// Run all the benchmarks and report the results.
+// F = clock face, A = clock face in adjust mode, D = demo.
+{
+  Serial.print(F("\n[Render Benchmark]"));
+  bBenchRun = true;
+
+  for (uint8_t i = 0; i < CLKFACE_COUNT; i++)
+  {
+    benchClock(i, false);
+    benchClock(i, true);
+  }
+
+  for (uint8_t i = 0; i < ARRAY_SIZE(demoFX); i++)
+    benchDemo(i);
+
+  // put everything back the way it was
+  bBenchRun = false;
+  curClkFace = 0;
+  clearAll();
+  Serial.print(F("\n[Benchmark end]\n"));
+}
+#endif
+
+#if REPLAY_TRACE
+// -------------------------------------
+// Input trace replay
+// Plays replayTrace[] into the inputs and reports the latency to 
+// the first frame shown after each event and its hash.
+
+static uint8_t rpIdx = 0;       // next event in the trace
+static uint32_t rpTimeStart = 0;// millis() the replay started, 0 before
+static bool rpWait = false;     // waiting for the frame after an event
+static uint32_t rpTimeEvent;    // micros() the event was injected
+static uint32_t rpTimeEventMs;  // millis() the event was injected
+static uint32_t rpGolden;       // golden hash for the event
+#if HW_USE_BLUETOOTH
+static const char *rpStr = nullptr; // rest of a BT string held up by a full command queue
+#endif
+static uint32_t rpLatSum = 0, rpLatMax = 0; // latency totals (us)
+static uint8_t rpFrames = 0, rpNoFrame = 0, rpFail = 0; // event results
+
+void replayResult(bool bFrame)
+// Report the result for the last event injected
+{
+  Serial.print(F("\nE"));
+  Serial.print(rpIdx - 1);
+  if (!bFrame)
+  {
+    Serial.print(F(" no frame"));
+    rpNoFrame++;
+  }
+  else
+  {
+    uint32_t lat = rpShowTime - rpTimeEvent;
+
+    rpFrames++;
+    rpLatSum += lat;
+    if (lat > rpLatMax) rpLatMax = lat;
+    Serial.print(F(" latency us:"));
+    Serial.print(lat);
+    Serial.print(F(" hash:0x"));
+    Serial.print(rpShowHash, HEX);
+    if (rpGolden != 0)
+    {
+      bool bOk = (rpGolden == rpShowHash);
+
+      if (!bOk) rpFail++;
+      Serial.print(bOk ? F(" ok") : F(" FAIL"));
+    }
+  }
+  rpWait = false;
+}
+
+#if HW_USE_BLUETOOTH
+const char *replayBT(const char *p)
+// Feed the BT string in PROGMEM to the packet parser.
+// Returns nullptr when done, or where to carry on if the command queue is full.
+{
+  for (; pgm_read_byte(p) != '\0'; p++)
+  {
+    if (!BT.inject(pgm_read_byte(p)))
+      return(p);
+  }
+  return(nullptr);
+}
+#endif
+
+void taskReplay(void)
+// Inject the trace events when they are due and collect the results
+{
+  replayEvent_t e;
+
+  // start once the BT device is ready to process packets
+  if (rpTimeStart == 0)
+  {
+#if HW_USE_BLUETOOTH
+    if (!BT.isReady()) return;
+#endif
+    Serial.print(F("\n[Replay Trace]"));
+    rpTimeStart = millis();
+  }
+
+  if (rpWait)
+  {
+    if (rpShown)
+      replayResult(true);
+    else if (millis() - rpTimeEventMs >= REPLAY_TIMEOUT)
+      replayResult(false);
+  }
+
+#if HW_USE_BLUETOOTH
+  // finish feeding the last BT string before the next event
+  if (rpStr != nullptr)
+  {
+    rpStr = replayBT(rpStr);
+    return;
+  }
+#endif
+
+  memcpy_P(&e, &replayTrace[rpIdx], sizeof(e));
+  if (e.type == RP_END)
+  {
+    if (!rpWait)
+    {
+#if USE_LDR_SENSOR
+      LDR.injectEnd();  // back to the live sensor
+#endif
+      Serial.print(F("\nFrames:"));  Serial.print(rpFrames);
+      Serial.print(F(" no frame:")); Serial.print(rpNoFrame);
+      Serial.print(F(" fail:"));     Serial.print(rpFail);
+      Serial.print(F(" avg us:"));   Serial.print(rpFrames != 0 ? rpLatSum / rpFrames : 0);
+      Serial.print(F(" max us:"));   Serial.print(rpLatMax);
+      Serial.print(F("\n[Replay end]\n"));
+      Tasks.stop(TASK_REPLAY);
+    }
+    return;
+  }
+
+  if (millis() - rpTimeStart < e.time)
+    return;
+
+  if (rpWait)   // next event is due before a frame was shown
+    replayResult(false);
+
+  switch (e.type)
+  {
+#if HW_USE_BLUETOOTH
+  case RP_BT:   rpStr = replayBT(e.str); break;
+#endif
+#if HW_USE_IR
+  case RP_IR:   IR.inject(e.data);  break;
+#endif
+  case RP_SW:   UI.inject((MD_KeySwitch::keyResult_t)e.data); break;
+#if USE_LDR_SENSOR
+  case RP_LDR:  LDR.inject(e.data); break;
+#endif
+  case RP_RTC:
+    RTC.h = (e.data >> 16) & 0xff;
+    RTC.m = (e.data >> 8) & 0xff;
+    RTC.s = e.data & 0xff;
+    writeRTC();
+    timeManual();
+    break;
+  }
+
+  rpIdx++;
+  rpGolden = e.golden;
+  rpArmed = (e.type == RP_LDR || e.type == RP_RTC);  // no command, the next frame shows it
+  rpShown = false;
+  rpWait = true;
+  rpTimeEventMs = millis();
+  rpTimeEvent = micros();
+}
+#endif
+
 // -------------------------------------
 // Command detection
+static bool bSwitchHold = false; // mode switch held from power up - ignore it
+static bool bSwitchReleased = false; // mode switch seen released once
+static uint8_t cmdSrc = 0;       // input to take the next command from first
+
+void taskSwitchWait(void)
+// Wait for the mode switch held at power up to be released.
+// It must be seen released on two checks to avoid switch bounce.
+{
+  if (digitalRead(MODE_SWITCH_PIN) == MODE_SWITCH_ACTIVE)
+    bSwitchReleased = false;
+  else if (!bSwitchReleased)
+    bSwitchReleased = true;
+  else
+  {
+    bSwitchHold = false;
+    Tasks.stop(TASK_SWITCH);
+  }
+}
+
 void getCommand(void)
 // Handle the interfaces to queue commands received
 {
@@ -512,135 +1446,397 @@ void getCommand(void)
   if (BT.getCommand())    // Bluetooth interface
   {
     PRINTCMD("\n+Q BT ", BT.c);
-    ENQUEUE(BT.c);
+    QBT.push(BT.c);
   }
 #endif
 #if HW_USE_IR
   if (IR.getCommand())    // Infrared interface
   {
     PRINTCMD("\n+Q IR ", IR.c);
-    ENQUEUE(IR.c);
+    QIR.push(IR.c);
   }
 #endif
 
-  if (UI.getCommand())  // Physical (switch) interface
+  if (!bSwitchHold && UI.getCommand())  // Physical (switch) interface
   {
     PRINTCMD("\n+Q SW ", UI.c);
-    ENQUEUE(UI.c);
+    QUI.push(UI.c);
   }
 }
 
-// -------------------------------------
-// Arduino Standard functions
-void setup(void)
+bool nextCommand(cmdQ_t &c)
+// Get the next queued command, taking the inputs in turn
+// Returns false if there are none waiting
 {
-#if DEBUG
-  Serial.begin(57600);
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    bool b = false;
+
+    switch ((cmdSrc + i) % 3)
+    {
+    case 0: b = QUI.pop(c); break;
+#if HW_USE_BLUETOOTH
+    case 1: b = QBT.pop(c); break;
 #endif
-  PRINTS("\n[Chroniker Clock Debug]");
+#if HW_USE_IR
+    case 2: b = QIR.pop(c); break;
+#endif
+    }
 
-  // Start up the library code(s)
-  FastLED.addLeds<LED_TYPE, LED_PIN, COLOR_ORDER>(leds, NUM_LEDS).setCorrection(TypicalLEDStrip);
-  Wire.begin();   // I2C library
+    if (b)
+    {
+      cmdSrc = (cmdSrc + i + 1) % 3;
+      return(true);
+    }
+  }
 
-  // turn the clock on to 12H mode, 
-  // and set for 1 second callback type alarm
-  RTC.control(DS3231_12H, DS3231_ON);
-  RTC.setAlarm1Callback(cbClock);
-  RTC.setAlarm1Type(DS3231_ALM_SEC);
+  return(false);
+}
 
-  // Start the control interfaces
 #if HW_USE_BLUETOOTH
-  BT.begin(); // Bluetooth
+const uint8_t DIAG_GOV = PROF_STAGES + 1;  // diagnostics page for the frame rate governor
+const uint8_t DIAG_SYNC = DIAG_GOV + 1;    // diagnostics page for the time sync history
+
+void sendDiag(uint8_t page)
+// Send a page of the diagnostics snapshot to the BT master.
+// Page 0 is the counters, pages 1 to PROF_STAGES the loop stage histograms,
+// page DIAG_GOV the frame rate governor statistics for each mode and 
+// page DIAG_SYNC the time sync offset history.
+{
+  if (page == 0)
+  {
+    struct
+    {
+      uint32_t loops;       // passes through loop()
+      uint32_t shows;       // LED updates sent
+      uint32_t skips;       // LED updates skipped as unchanged
+      uint16_t qDrops;      // commands dropped from the queues
+      uint16_t pktErrors;   // BT packets rejected
+      uint16_t rxOverflow;  // BT receive buffer overflows
+      uint16_t rxDropped;   // BT characters discarded
+      uint16_t txOverflow;  // BT responses dropped
+      uint16_t fadeAvg;     // average crossfade blend time (us)
+      uint16_t fadeMax;     // longest crossfade blend time (us)
+    } d;
+
+#if PROFILE_LOOP
+    d.loops = loopCount;
+#else
+    d.loops = 0;
 #endif
+    d.shows = showCount;
+    d.skips = showSkip;
+    d.qDrops = QUI.getDropped() + QBT.getDropped();
 #if HW_USE_IR
-  IR.begin(); // IR Remote
+    d.qDrops += QIR.getDropped();
 #endif
-  UI.begin(); // User switches
-
-#if USE_LDR_SENSOR
-  pinMode(LDR_SENSOR, INPUT); // set the LDR input port
+    d.pktErrors = BT.getPktErrors();
+    d.rxOverflow = BT.getRxOverflow();
+    d.rxDropped = BT.getRxDropped();
+    d.txOverflow = BT.getTxOverflow();
+    d.fadeAvg = Fade.getTimeAvg();
+    d.fadeMax = Fade.getTimeMax();
+    BT.sendData(CMD_DIAG, page, &d, sizeof(d));
+  }
+#if PROFILE_LOOP
+  else if (page <= PROF_STAGES)
+    BT.sendData(CMD_DIAG, page, Prof.getHist(page - 1), sizeof(profHist_t));
 #endif
+  else if (page == DIAG_GOV)
+    BT.sendData(CMD_DIAG, page, Gov.getStats(GOV_IDLE), sizeof(govStats_t) * GOV_MODES);
+  else if (page == DIAG_SYNC)
+    BT.sendData(CMD_DIAG, page, Sync.getHistory(), sizeof(syncRec_t) * Sync.getCount());
+}
 
-  // Check if lamp test is needed invoked -
-  // startup with the mode switch active.
-  if (digitalRead(MODE_SWITCH_PIN) == MODE_SWITCH_ACTIVE)
+// Device state fields sent to the BT master, in bit order in the frame id
+enum stateField_e { SF_RUN, SF_HOUR, SF_MINUTE, SF_SECOND, SF_BRIGHT, SF_CLKFACE, SF_DEMO, SF_THEME, SF_COUNT };
+
+static_assert(SF_COUNT <= 8 && SF_COUNT <= BT_STATE_MAX, "State fields must fit in the frame id and BT_STATE_MAX");
+
+static uint8_t stateSent[SF_COUNT]; // state fields as last sent to the BT master
+
+void getState(uint8_t *s)
+// Fill in the current device state, one byte for each SF_* field
+{
+  s[SF_RUN] = runState;
+  s[SF_HOUR] = RTC.h;
+  s[SF_MINUTE] = RTC.m;
+  s[SF_SECOND] = RTC.s;
+  s[SF_BRIGHT] = curBright;
+  s[SF_CLKFACE] = curClkFace;
+  s[SF_DEMO] = curDemo;       // 0xff for no demo
+  s[SF_THEME] = Themes.getTheme();
+}
+
+bool sendState(bool bAll)
+// Send all the state fields, or only those changed since they were last 
+// sent, to the BT master. The frame id is the mask of the fields sent.
+// Returns true if a frame was queued.
+{
+  uint8_t s[SF_COUNT], d[SF_COUNT];
+  uint8_t mask = 0, len = 0;
+
+  getState(s);
+  for (uint8_t i = 0; i < SF_COUNT; i++)
   {
-    // queue the lamp test
-    PRINTS("\nLamp Test");
-    ENQUEUE_C(CMD_LAMPTEST, 0);
+    bool bSend = bAll || (i != SF_SECOND && s[i] != stateSent[i]);
 
-    while (digitalRead(MODE_SWITCH_PIN) == MODE_SWITCH_ACTIVE)
-      ; // wait for switch release
-    delay(100); // avoid switch bounce
-  } 
+    // the seconds change too often to notify on their own, they go with the minutes
+    if (i == SF_SECOND && (mask & ((1 << SF_HOUR) | (1 << SF_MINUTE))))
+      bSend = true;
 
-  PRINT("\nSetup exit, free mem ", freeMemory());
+    if (bSend)
+    {
+      mask |= (1 << i);
+      d[len++] = s[i];
+    }
+  }
+
+  if (mask == 0 || !BT.sendData(CMD_QUERY, mask, d, len))
+    return(false);
+
+  memcpy(stateSent, s, sizeof(stateSent));
+  return(true);
 }
+#endif
 
-void loop (void) 
+void taskNotify(void)
+// Send the changed state fields to the BT master. Nothing is sent while
+// an input is busy or a response is still waiting to go, so notifications
+// never hold up the inputs.
+{
+#if HW_USE_BLUETOOTH
+  if (inputBusy() || !BT.isTxIdle())
+    return;
+
+  sendState(false);
+#endif
+}
+
+void getSettings(uint8_t *v)
+// Fill in the settings kept in the journal, one byte for each JF_* field
+{
+  v[JF_BRIGHT] = curBright;
+  v[JF_CLKFACE] = curClkFace;
+  v[JF_DEMO] = curDemo;       // 0xff for no demo
+}
+
+void restoreSettings(void)
+// Restore the settings saved in the journal before the last power down
+{
+  uint8_t v[JF_COUNT];
+
+  getSettings(v);
+  Journal.begin(v);
+
+  curBright = v[JF_BRIGHT];
+  if (v[JF_CLKFACE] < CLKFACE_COUNT)
+    curClkFace = v[JF_CLKFACE];
+  if (v[JF_DEMO] < ARRAY_SIZE(demoFX))
+  {
+    curDemo = v[JF_DEMO];
+    runState = RUN_DEMO;
+    FX.start(&demoFX[curDemo]);
+  }
+  setBrightness();
+}
+
+void doCommand(cmdQ_t &c)
+// Process one command taken from the queues
 {
-  static bool newDemo;
+  PRINTCMD("\n-Q ", c);
+#if REPLAY_TRACE
+  rpArmed = true;   // frames from now show the replayed command
+#endif
+
+  // any other command interrupts the lamp test
+  if (runState == RUN_LAMPTEST && c.cmd != CMD_LAMPTEST)
+    stopLampTest();
 
-  cmdQ_t c = { 0, 0 };
+  switch (c.cmd)
+  {
+  case CMD_LAMPTEST:  // do lamp test cycle
+    startLampTest();
+    break;
 
-  // -- Process the command queue
-  getCommand();
-  if (!Q.isEmpty())
+  case CMD_RESET:     // soft reset (reboot)
   {
-    DEQUEUE(c);
-    PRINTCMD("\n-Q ", c);
+    uint8_t v[JF_COUNT];
+
+    getSettings(v);
+    Journal.flush(v);   // do not lose settings still waiting to be written
+    hwReset();
+  }
+  break;
 
-    switch (c.cmd)
+  case CMD_SETUP:     // set the time on the clock
+    bSyncDue = false;   // the time is being set by hand
+    if (runState != RUN_SETUP) Fade.start();
+    runState = RUN_SETUP;
+    break;
+    
+  case CMD_DEMO:     // start, cycle or stop the demo effects
+    Fade.start();
+    if (c.data == CD_OFF)
     {
-    case CMD_LAMPTEST:  // do lamp test cycle
-      lampTest();
-      break;
+      FX.stop();
+      curDemo = -1;
+      runState = RUN_INIT;
+      showClock();
+    }
+    else
+    {
+      runState = RUN_DEMO;
+      curDemo = (curDemo + 1) % ARRAY_SIZE(demoFX);
+      FX.start(&demoFX[curDemo]);
+    }
+    break;
 
-    case CMD_RESET:     // soft reset (reboot)
-      hwReset();
-      break;
+  case CMD_CLKFACE:   // select or cycle the clock face
+  {
+    uint8_t face = curClkFace;
 
-    case CMD_SETUP:     // set the time on the clock
-      runState = RUN_SETUP;
-      break;
-      
-    case CMD_DEMO:     // set the time on the clock
-      if (c.data == CD_OFF)
-      {
-        curDemo = -1;
-        runState = RUN_INIT;
-      }
-      else
-      {
-        runState = RUN_DEMO;
-        curDemo++;
-        newDemo = true;
-      }
-      break;
+    if (c.data == CC_CYCLE)
+      face = (curClkFace + 1) % CLKFACE_COUNT;
+    else if (c.data >= '0' && c.data < '0' + CLKFACE_COUNT)
+      face = c.data - '0';
 
-    case CMD_CLKFACE:
-      if (c.data == CC_CYCLE)
-        curClkFace++;
-      break;
+    if (face == curClkFace)
+      break;    // no such face or no change - nothing to redraw
+    curClkFace = face;
+    if (runState == RUN_NORMAL)
+    {
+      Fade.start();
+      showClock();
+    }
+  }
+  break;
 
-    case CMD_BRIGHT:  // change base brightness
-      setBrightness(c.data, true);
-      PRINT("\nsetBright = ", c.data);
-      break;
+#if HW_USE_IR
+  case CMD_IRMODE:    // select the remote profile or learn codes
+    if (c.data == CI_LEARN)
+      IR.learn();
+    else
+      IR.setProfile(c.data - '0');
+    break;
+#endif
+
+  case CMD_THEME:     // select the colour theme
+    if (Themes.select(c.data - '0'))
+      showTheme();
+    break;
 
-    case CMD_TIME:    // set the time directly
-      RTC.s = (c.data & 0xff);
-      c.data >>= 8;
-      RTC.m = (c.data & 0xff);
-      c.data >>= 8;
-      RTC.h = (c.data & 0xff);
-      RTC.writeTime();
+  case CMD_COLOUR:    // change a user theme colour
+    if (Themes.setColour(c.data >> 24, c.data & 0xffffff))
+      showTheme();
+    break;
+
+#if HW_USE_BLUETOOTH
+  case CMD_DIAG:      // diagnostics snapshot
+    sendDiag(c.data - '0');
+    break;
+
+  case CMD_ECHO:      // time sync round trip - return the timestamp with millis()
+  {
+    uint32_t d[2] = { c.data, millis() };
+
+    BT.sendData(CMD_ECHO, 0, d, sizeof(d));
+  }
+  break;
+
+  case CMD_QUERY:     // device state snapshot and change notifications
+    if (c.data == CQ_QUIET)
+      Tasks.stop(TASK_NOTIFY);
+    else
+    {
+      sendState(true);    // room was checked before the request was acknowledged
+      if (c.data == CQ_NOTIFY)
+        Tasks.start(TASK_NOTIFY, STATE_NOTIFY_PERIOD);
+    }
+    break;
+#endif
+
+  case CMD_BRIGHT:  // change base brightness
+    setBrightness(c.data, true);
+    PRINT("\nsetBright = ", c.data);
+    break;
+
+  case CMD_TIME:    // set the time directly
+    setTime24((c.data >> 16) & 0xff, (c.data >> 8) & 0xff, c.data & 0xff);
+    writeRTC();
+    timeManual();
+    break;
+
+  case CMD_SYNC:    // set the time to the ms on the next second
+    timeSync(c.data);
+    break;
+  }
+
+  // adjustments go to the time setup FSM
+  if (runState == RUN_SETUP && (c.cmd == CMD_SELECT || c.cmd == CMD_VALUE))
+  {
+    if (adjustTime(c.cmd, c.data))
+    {
+      Fade.start();
+      runState = RUN_INIT;
+      showClock();
     }
   }
 
-  // -- Execute the LED display FSM
- switch (runState)
+  // note any settings changed for the journal
+  {
+    uint8_t v[JF_COUNT];
+
+    getSettings(v);
+    Journal.check(v);
+  }
+}
+
+void taskInput(void)
+// Poll the inputs and process the command queues in bounded batches
+{
+  cmdQ_t c;
+
+#if USE_LDR_SENSOR
+  LDR.run();    // ambient light in the background
+#endif
+  {
+    PROF_START(timeInput);
+    getCommand();
+    PROF_STOP(PROF_INPUT, timeInput);
+  }
+  {
+    PROF_START(timeDispatch);
+    for (uint8_t i = 0; i < CMD_BATCH && nextCommand(c); i++)
+      doCommand(c);
+    PROF_STOP(PROF_DISPATCH, timeDispatch);
+  }
+  {
+    uint8_t v[JF_COUNT];
+
+    getSettings(v);
+    Journal.run(v); // write settled settings changes
+  }
+}
+
+void taskDisplay(void)
+// Execute the LED display FSM
+{
+  PROF_START(timeFSM);
+
+  // -- Set the frame rate for the input activity
+#if HW_USE_IR
+  if (Gov.run(inputBusy(), showCount, IR.getCodes(), IR.getMalformed()))
+#else
+  if (Gov.run(inputBusy(), showCount, 0, 0))
+#endif
+    FX.setPeriod(Gov.getPeriod());
+
+  // -- Keep the time and write any synchronised time on its second boundary
+  runTime();
+  syncWrite();
+
+  switch (runState)
   {
   case RUN_INIT:
     PRINTFSM("\nRUN_INIT", runState);
@@ -650,31 +1846,37 @@ void loop (void)
 
   case RUN_NORMAL:
     PRINTFSM("\nRUN_NORMAL", runState);
-    RTC.checkAlarm1();  // callback will do the work of updates
+    if (bTick)
+    {
+      bTick = false;
+      showTick();
+    }
+    // smooth face redraws between the ticks at the frame rate
+    if (curClkFace == CLKFACE_SMOOTH && millis() - timeSmooth >= Gov.getPeriod())
+    {
+      timeSmooth = millis();
+      showClock();
+    }
     break;
 
   case RUN_SETUP:
     PRINTFSM("\nRUN_SETUP", runState);
-    if (adjustTime(c.cmd, c.data))
+    if (adjustTime(0, 0))   // blink and finish the setup
+    {
+      Fade.start();
       runState = RUN_INIT;
+      showClock();
+    }
     break;
 
+  case RUN_LAMPTEST:
+    PRINTFSM("\nRUN_LAMPTEST", runState);
+    break;    // the lamp test task owns the display
+
   case RUN_DEMO:
     PRINTFSM("\nRUN_DEMO", runState);
-    switch (curDemo)
-    {
-      case 0: demoCylon(newDemo);    newDemo = false; break;
-      case 1: demoRainbow(newDemo);  newDemo = false; break;
-      case 2: demoRainbowWithGlitter(newDemo); newDemo = false; break;
-      case 3: demoConfetti(newDemo); newDemo = false; break;
-      case 4: demoSinelon(newDemo);  newDemo = false; break;
-      case 5: demoBPM(newDemo);      newDemo = false; break;
-      case 6: demoJuggle(newDemo);   newDemo = false; break;
-      default:    // cycled too far, reset it
-        curDemo = 0;
-        newDemo = true;
-        break;
-    }
+    if (FX.run())   // the scheduler sets the frame rate
+      updateDisplay();
     break;
 
   default:
@@ -682,4 +1884,176 @@ void loop (void)
     runState = RUN_INIT;
     break;
   }
+  PROF_STOP(PROF_FSM, timeFSM);
+
+  // -- Step any crossfade on its own frame clock
+  if (Fade.run())
+    updateDisplay();
+
+  // -- Send any LED update held back by busy inputs
+  serviceDisplay();
+}
+
+// -------------------------------------
+// SRAM use
+// Counted after all the file scope state is defined, checked at compile time
+
+// Application objects and buffers
+const uint16_t RAM_OBJECTS = sizeof(leds) + sizeof(pix) + sizeof(Themes) + sizeof(Fade) + sizeof(Gov) + sizeof(Sync) + sizeof(Journal) + sizeof(FX) + sizeof(QUI) + sizeof(UI) + sizeof(taskTable) + sizeof(Tasks)
+#if USE_LDR_SENSOR
+  + sizeof(LDR)
+#endif
+#if HW_USE_BLUETOOTH
+  + sizeof(QBT) + sizeof(BT)
+#endif
+#if HW_USE_IR
+  + sizeof(QIR) + sizeof(IR)
+#endif
+#if PROFILE_LOOP
+  + sizeof(Prof)
+#endif
+  ;
+
+// File scope state of the application
+const uint16_t RAM_STATE = sizeof(runState) + sizeof(curDemo) + sizeof(curClkFace) + sizeof(curBright) + sizeof(hwReset)
+  + sizeof(showCount) + sizeof(showSkip) + sizeof(showDefer) + sizeof(showForced) + sizeof(showPending) + sizeof(showHash) + sizeof(timeDefer)
+  + sizeof(adjState) + sizeof(adjTimeStart) + sizeof(adjBlink)
+  + sizeof(timeSmooth) + sizeof(timeTick) + sizeof(i2cCount) + sizeof(i2cRate) + sizeof(bTick)
+  + sizeof(bSyncDue) + sizeof(syncDue) + sizeof(syncSecond)
+  + sizeof(lampStep) + sizeof(timeHue) + sizeof(hue) + sizeof(idx) + sizeof(state)
+  + sizeof(bSwitchHold) + sizeof(bSwitchReleased) + sizeof(cmdSrc)
+#if HW_USE_RTC_SQW
+  + sizeof(tickCount) + sizeof(rtcResync)
+#endif
+#if HW_USE_BLUETOOTH
+  + sizeof(stateSent)
+#endif
+#if PROFILE_LOOP
+  + sizeof(loopCount) + sizeof(timeLoop)
+#endif
+#if PROFILE_DEBUG
+  + sizeof(smoothTime) + sizeof(smoothFrames) + sizeof(smoothMax) + sizeof(smoothOver)
+#endif
+#if BENCH_RENDER
+  + sizeof(bBenchRun) + sizeof(benchPrev)
+#endif
+#if REPLAY_TRACE
+  + sizeof(rpArmed) + sizeof(rpShown) + sizeof(rpShowTime) + sizeof(rpShowHash)
+  + sizeof(rpIdx) + sizeof(rpTimeStart) + sizeof(rpWait) + sizeof(rpTimeEvent) + sizeof(rpTimeEventMs) + sizeof(rpGolden)
+  + sizeof(rpLatSum) + sizeof(rpLatMax) + sizeof(rpFrames) + sizeof(rpNoFrame) + sizeof(rpFail)
+#if HW_USE_BLUETOOTH
+  + sizeof(rpStr)
+#endif
+#endif
+  ;
+
+const uint16_t RAM_USED = RAM_OBJECTS + RAM_STATE;
+
+static_assert(RAM_USED <= RAM_BUDGET, "Application objects, buffers and state are over the SRAM budget");
+
+void ramReport(void)
+// Print the SRAM used by each module
+{
+  PRINT("\nRAM leds:", sizeof(leds));
+  PRINT(" pix:", sizeof(pix) + sizeof(Themes));
+  PRINT(" fade:", sizeof(Fade));
+  PRINT(" gov:", sizeof(Gov));
+  PRINT(" sync:", sizeof(Sync));
+  PRINT(" journal:", sizeof(Journal));
+  PRINT(" FX:", sizeof(FX));
+  PRINT(" UI:", sizeof(UI) + sizeof(QUI));
+#if USE_LDR_SENSOR
+  PRINT(" LDR:", sizeof(LDR));
+#endif
+#if HW_USE_BLUETOOTH
+  PRINT(" BT:", sizeof(BT) + sizeof(QBT));
+#endif
+#if HW_USE_IR
+  PRINT(" IR:", sizeof(IR) + sizeof(QIR));
+#endif
+  PRINT(" Tasks:", sizeof(taskTable) + sizeof(Tasks));
+#if PROFILE_LOOP
+  PRINT(" Prof:", sizeof(Prof));
+#endif
+  PRINT(" state:", RAM_STATE);
+  PRINT(" total:", RAM_USED);
+  PRINT(" budget:", RAM_BUDGET);
+}
+
+// -------------------------------------
+// Arduino Standard functions
+void setup(void)
+{
+#if DEBUG || BENCH_RENDER || REPLAY_TRACE
+  Serial.begin(57600);
+#endif
+  PRINTS("\n[Chroniker Clock Debug]");
+
+  // Start up the library code(s)
+  FastLED.addLeds<LED_TYPE, LED_PIN, COLOR_ORDER>(leds, NUM_LEDS).setCorrection(TypicalLEDStrip);
+  Wire.begin();   // I2C library
+
+  // turn the clock on to 12H mode, 
+  // and set for 1 second callback type alarm
+  // or 1Hz square wave interrupt
+  RTC.control(DS3231_12H, DS3231_ON);
+#if HW_USE_RTC_SQW
+  RTC.control(DS3231_SQW_TYPE, DS3231_SQW_1HZ);
+  RTC.control(DS3231_INT_ENABLE, DS3231_OFF);   // INT/SQW pin outputs the square wave
+  pinMode(RTC_SQW_PIN, INPUT_PULLUP);           // open drain output
+  attachInterrupt(digitalPinToInterrupt(RTC_SQW_PIN), isrTick, FALLING);
+#else
+  RTC.setAlarm1Callback(cbClock);
+  RTC.setAlarm1Type(DS3231_ALM_SEC);
+#endif
+  Sync.begin((int8_t)RTC.status(DS3231_AGING_OFFSET));
+
+  // Start the control interfaces
+#if HW_USE_BLUETOOTH
+  BT.begin(); // Bluetooth
+#endif
+#if HW_USE_IR
+  IR.begin(); // IR Remote
+#endif
+  UI.begin(); // User switches
+
+#if USE_LDR_SENSOR
+  LDR.begin();  // ambient light sensor
+#endif
+  Themes.begin(); // colour theme
+#if BENCH_RENDER
+  benchRender();  // before the restore, as it resets the face and stops FX
+#endif
+  restoreSettings();
+
+  Tasks.begin();
+  Gov.begin();
+
+  // Check if lamp test is needed invoked -
+  // startup with the mode switch active.
+  if (digitalRead(MODE_SWITCH_PIN) == MODE_SWITCH_ACTIVE)
+  {
+    // queue the lamp test and ignore the switch until released
+    PRINTS("\nLamp Test");
+    QUI.push(CMD_LAMPTEST, 0);
+    bSwitchHold = true;
+    Tasks.start(TASK_SWITCH);
+  } 
+
+#if REPLAY_TRACE
+  Tasks.start(TASK_REPLAY);
+#endif
+
+  ramReport();
+  PRINT("\nSetup exit, free mem ", freeMemory());
+}
+
+void loop (void) 
+{
+#if PROFILE_LOOP
+  if (loopCount++ != 0)
+    PROF_STOP(PROF_LOOP, timeLoop);
+  timeLoop = Prof.start();
+#endif
+  Tasks.run();
 }
@@ -3,7 +3,6 @@
 #define USE_ALTSOFTSERIAL 0
 
 #include <Arduino.h>
-#include <MD_CirQueue.h>
 #include "Chroniker.h"
 
 #if USE_ALTSOFTSERIAL
@@ -27,9 +26,20 @@ with the following request/response pattern
 where
 <Start_Char> is a single character used to synch the start of the data packet (PKT_START)
 <Command> is an identifier for the action requested (PKT_CMD_*)
-<Data> is an optional single character for data supporting <Command>
+<Data> is optional data supporting <Command>, usually a single character.
+  PKT_CMD_BRIGHT has 3 decimal digits, PKT_CMD_TIME has 6 decimal digits
+  HHMMSS (hours 0-23), PKT_CMD_SYNC has 9 decimal digits HHMMSSmmm, 
+  PKT_CMD_COLOUR has 8 hex digits, the palette entry then the RGB colour 
+  (EERRGGBB), and PKT_CMD_ECHO has 8 hex digits, the master timestamp.
 <End_Char> marks the end of a data packet (PKT_END)
 
+All the characters waiting in the serial receive buffer are processed on each
+call to getCommand(), up to BT_RX_BUDGET characters, so a whole packet is 
+normally handled in one pass through loop(). Completed commands are held in a
+queue of BT_CMD_MAX and returned one per call. Serial receive buffer 
+overflows and characters discarded (outside a packet or in a bad packet) are
+counted.
+
 A request is always followed by a response in the format
 <Start_Char><Cmd><Error_Code><End_Char>
 where
@@ -41,16 +51,120 @@ Packets of data time out if they are not received in their entirety within
 BT_COMMS_TIMEOUT milliseconds and the requester should expect a response with the same
 timeout BT_COMMS_TIMEOUT period.
 
-The Bluetooth device is initialised in the begin() method. The hardware MUST NOT BE CONNECTED
-to a master (eg, BT application) or the initialisation parameters will be passed through the 
-serial interface rather than setting up the BT device.
+Binary protocol
+---------------
+For bulk operations the BT master can also send binary frames, each carrying
+several commands, in the format
+<Bin_Start><Seq><Len><Payload><CRC>
+where
+<Bin_Start> is the byte PKT_BIN_START, which can never start an ASCII packet
+<Seq> is a frame sequence number (0-255), incremented for every frame
+<Len> is the number of bytes in <Payload> (1 to BT_BIN_MAX)
+<Payload> is one or more commands, each a command byte (PKT_CMD_*) followed by
+  its data in binary. The data for each command is
+  - PKT_CMD_LAMPTEST, PKT_CMD_RESET, PKT_CMD_SETUP: no data
+  - PKT_CMD_SELECT, PKT_CMD_VALUE, PKT_CMD_DEMO, PKT_CMD_CLKFACE, 
+    PKT_CMD_IRMODE, PKT_CMD_DIAG, PKT_CMD_THEME, PKT_CMD_QUERY: 1 byte, the
+    same character as the ASCII packet
+  - PKT_CMD_BRIGHT: 1 byte brightness (0-255)
+  - PKT_CMD_TIME: 3 bytes hours (0-23), minutes, seconds
+  - PKT_CMD_SYNC: 4 bytes ms of the day, MSB first
+  - PKT_CMD_COLOUR: 4 bytes palette entry, red, green, blue
+  - PKT_CMD_ECHO: 4 bytes master timestamp, MSB first
+<CRC> is the CRC-8 (polynomial 0x07, initial value 0) of <Seq>, <Len> and <Payload>
+
+The commands in a frame are only actioned if the whole frame is valid. A frame
+with sequence number 0 always restarts the sequence, otherwise each frame must
+have the sequence number following the last good frame. Frames may be sent
+without waiting for the response to the previous frame. Good frames are
+acknowledged with a single response once no more data is waiting, so several
+frames can be acknowledged by one response. An error is responded to straight
+away. The binary response is
+<Bin_Start><PKT_CMD_ACK><Seq><Error_Code><CRC>
+where <Seq> is the sequence number of the last good frame, <Error_Code> is as
+for the ASCII response and <CRC> is the CRC-8 of <PKT_CMD_ACK>, <Seq> and
+<Error_Code>. On an error the master should resend all frames after <Seq>.
+PKT_ERR_FULL means the frame was good but its commands did not fit in the
+command queue, and the master should wait a little before resending.
+
+Data frames
+-----------
+Some commands (eg, PKT_CMD_DIAG) return data to the master after the 
+normal response. The data is always sent as a binary frame
+<Bin_Start><Cmd><Id><Len><Data><CRC>
+where <Cmd> is the command requesting the data, <Id> identifies the data
+returned (eg, the page number), <Len> is the number of bytes in <Data> and
+<CRC> is the CRC-8 of <Cmd>, <Id>, <Len> and <Data>. Multi byte values in 
+<Data> are little endian.
+
+PKT_CMD_QUERY returns the device state as a data frame where <Id> is a bit
+mask of the state fields in <Data>, one byte each in bit order (see the 
+application for the fields). A snapshot has all the fields. After a 
+PKT_CMD_QUERY with CQ_NOTIFY the slave also sends, unasked, a frame with 
+only the fields that have changed, from whatever source, until CQ_QUIET 
+is received. These are only sent when the transmit queue is empty and no
+input is being received, so they are rate limited and never hold up 
+commands from the master. Room for the snapshot is checked before the
+request is acknowledged. If there is none, the packet or frame is
+rejected with PKT_ERR_FULL as its only response, and the master should
+ask again.
+
+PKT_CMD_SYNC returns the RTC offset, the aging offset and a status byte
+in a data frame. The status is PKT_ERR_BUSY if the offset could not be
+measured and the sync should be sent again later. Room for this frame is
+also checked before the sync is acknowledged.
+
+Responses are not sent straight away. They are put in a transmit queue that
+is drained from getCommand() a few characters at a time, so that loop() 
+never waits for the serial link. With SoftwareSerial each character written 
+blocks for one character time, so one character is sent per call and only 
+when nothing is being received (SoftwareSerial is half duplex). With 
+AltSoftSerial up to BT_TX_BURST characters are passed to its interrupt 
+driven transmit buffer per call. Responses that do not fit in the queue are 
+dropped and counted, and the queue high water mark is recorded.
+
+FastLED.show() disables interrupts and corrupts any serial character being
+received by SoftwareSerial. isBusy() reports whether characters are waiting
+or have arrived within the last BT_BUSY_TIME milliseconds, so that LED 
+updates can be held back while a packet is being received.
+
+The Bluetooth device initialisation is started in the begin() method. The 
+AT commands are then sent in the background by getCommand(), one at a time
+through the transmit queue, without holding up the rest of the application.
+Each response is collected until end of line, AT_RESP_GAP ms of silence or 
+AT_RESP_TIMEOUT, and the result for each command is recorded (see 
+getATResult()). Packets are not processed until the initialisation is 
+complete, so the AT response shares its buffer with the packet data. The
+hardware MUST NOT BE CONNECTED to a master (eg, BT application)
+or the initialisation parameters will be passed through the serial interface
+rather than setting up the BT device.
 */
 
 // Serial protocol parameters
 const uint16_t BT_COMMS_TIMEOUT = 1000; // Protocol packet timeout period (start to end packet within this period)
+const uint16_t BT_BUSY_TIME = 10;       // ms after the last character received before the link is idle
 
 const char PKT_START = '*';    // protocol packet start character
 const char PKT_END = '~';      // protocol packet end character
+const uint8_t PKT_BIN_START = 0xa5; // binary frame start byte
+const uint8_t BT_BIN_MAX = 16;      // maximum binary frame payload bytes
+const uint8_t BT_CMD_MAX = 8;       // received commands waiting for getCommand() - must be a power of 2
+const uint8_t BT_RX_BUDGET = 32;    // max characters processed per getCommand() call
+const uint8_t BT_TX_SIZE = 64;      // transmit queue size - must be a power of 2
+const uint8_t BT_TX_BURST = 8;      // max characters passed to AltSoftSerial per call
+const uint8_t BT_ACK_SIZE = 5;      // bytes in an ASCII or binary response
+const uint8_t BT_STATE_MAX = 8;     // most state fields in a PKT_CMD_QUERY data frame
+const uint8_t BT_SYNC_SIZE = 6;     // data bytes in a PKT_CMD_SYNC data frame (offset, aging, status)
+
+// AT initialisation parameters
+const uint8_t BT_AT_MAX = 6;            // max AT commands in ATCmd[]
+const uint8_t BT_AT_RESP = 16;          // AT response buffer size
+const uint16_t AT_SETUP_TIME = 10;      // ms HC05 setup enable pulse
+const uint16_t AT_RESP_TIMEOUT = 500;   // ms to wait for an AT response
+const uint16_t AT_RESP_GAP = 50;        // ms silence that ends an AT response
+
+// AT command results
+enum atResult_e { AT_NONE, AT_SENT, AT_OK, AT_ERR, AT_TOUT };
 
 const char PKT_CMD_LAMPTEST = CMD_LAMPTEST;
 const char PKT_CMD_BRIGHT = CMD_BRIGHT;
@@ -61,6 +175,13 @@ const char PKT_CMD_VALUE = CMD_VALUE;
 const char PKT_CMD_TIME = CMD_TIME;
 const char PKT_CMD_DEMO = CMD_DEMO;
 const char PKT_CMD_CLKFACE = CMD_CLKFACE;
+const char PKT_CMD_IRMODE = CMD_IRMODE;
+const char PKT_CMD_DIAG = CMD_DIAG;
+const char PKT_CMD_THEME = CMD_THEME;
+const char PKT_CMD_COLOUR = CMD_COLOUR;
+const char PKT_CMD_QUERY = CMD_QUERY;
+const char PKT_CMD_ECHO = CMD_ECHO;
+const char PKT_CMD_SYNC = CMD_SYNC;
 const char PKT_CMD_ACK = 'Z';   // acknowledge command - data is PKT_ERR_* defines
 
 const char PKT_ERR_OK   = '0';  // no error/ok
@@ -68,6 +189,8 @@ const char PKT_ERR_TOUT = '1';  // timeout - start detected with no end within t
 const char PKT_ERR_CMD  = '2';  // command field not valid or unknown
 const char PKT_ERR_DATA = '3';  // data field not valid
 const char PKT_ERR_SEQ  = '4';  // generic protocol sequence error
+const char PKT_ERR_FULL = '5';  // command or transmit queue full - resend a little later
+const char PKT_ERR_BUSY = '6';  // command not possible now (eg, time sync in setup mode) - resend later
 
 // Set up BT module initialisation parameters
 // This depends on the BT module being used, as they need different AT commands.
@@ -98,274 +221,195 @@ class BTSerial: public iChroniker
 public:
   // Functions
   BTSerial(uint8_t pinRecv, uint8_t pinSend, const char* szBTName) :
-    _pinRecv(pinRecv), _pinSend(pinSend), _szBTName(szBTName)
-  {
-    c.cmd = c.data = 0;
-#if USE_ALTSOFTSERIAL
-    BTChan = new AltSoftSerial();
-#else
-    BTChan = new SoftwareSerial(BT_RECV_PIN, BT_SEND_PIN);
+    _pinRecv(pinRecv), _pinSend(pinSend), _szBTName(szBTName), _timeLastRx(0),
+    _atState(AT_DONE), _atStep(0),
+    _state(ST_IDLE), _rxOverflow(0), _rxDropped(0), _pktErrors(0), _cmdTail(0), _cmdCount(0), 
+    _binSeq(0), _bAckPending(false),
+    _txHead(0), _txTail(0), _txHighWater(0), _txOverflow(0)
+#if !USE_ALTSOFTSERIAL
+    , BTChan(pinRecv, pinSend)
 #endif
-  };
-
-  ~BTSerial()
   {
-    delete BTChan;
+    c.cmd = c.data = 0;
   };
 
   virtual void begin(void)
-  // initialise the BT device class for different hardware
+  // Start the serial interface and the BT device initialisation.
+  // The AT commands are sent in the background by getCommand().
   {
     const uint16_t BAUD = 9600;
-    char  szCmd[20], szResp[16];
-    uint8_t   i = 0;
-    bool  fLast = false;
 
     PRINT("\nStart BT connection at ", BAUD);
-    BTChan->begin(BAUD);
+    BTChan.begin(BAUD);
+
+    _atStep = 0;
+    _atIdx = 0;
+    for (uint8_t i = 0; i < BT_AT_MAX; i++)
+      _atResult[i] = AT_NONE;
 
 #if HW_USE_HC05
     // Switch the HC05 to setup mode using digital I/O
     pinMode(HC05_SETUP_ENABLE, OUTPUT);
     digitalWrite(HC05_SETUP_ENABLE, HIGH);
-    delay(10);   // just a small amount of time
-    digitalWrite(HC05_SETUP_ENABLE, LOW);
+    _timeAT = millis();
+    _atState = AT_SETUP;
+#else
+    _atState = AT_SEND;
 #endif
-
-    // Process all the AT commands for the selected BT module
-    // Send each command, read the response (or time out) and then
-    // do the next one.
-    // First item is always the name!
-    do
-    {
-      fLast = getATCmd(szCmd, ARRAY_SIZE(szCmd), (i == 0));
-
-      // Print the preamble, AT command, end of line by assembling the 
-      // data into a string of allocated memory. This allows the data to
-      // send out in one hit rather than piecemeal.
-      char *sz = (char *)malloc((strlen(szStart) + strlen_P(szCmd) + \
-                  strlen(_szBTName) + strlen(szEnd) + 1) * sizeof(char));
-      strcpy(sz, szStart);
-      strcat(sz, szCmd);
-      if (i == 0)  // first item - insert the name
-        strcat(sz, _szBTName);
-      strcat(sz, szEnd);
-      BTChan->print(sz);
-      BTChan->flush();
-
-      free(sz);
-      i++;
-
-      // Wait for and get the response, except for the 
-      // last one when we don't care as normally a RESET.
-      if (!fLast)
-      {
-        if (!getATResponse(szResp, ARRAY_SIZE(szResp)))
-        {
-          PRINT("\nBT err on ", szCmd);
-          PRINT(":", szResp);
-        }
-      }
-    } while (!fLast);
-
-    BTChan->flush();
   }
 
   virtual bool getCommand(void)
     // Call repeatedly to receive and process characters waiting in the serial queue
     // Return true when a good message is fully received
   {
-    static enum { ST_IDLE, ST_CMD, ST_DATA, ST_END } state = ST_IDLE;
-    static uint32_t timeStart = 0;
-    static uint8_t countTarget, countActual;
-    static char cBuf[10];
-    bool b = false;
+    // send some of any queued response
+    txDrain();
 
-    // check for timeout if we are currently mid packet
-    if (state != ST_IDLE)
+    // BT device is still being initialised
+    if (_atState != AT_DONE)
     {
-      if (millis() - timeStart >= BT_COMMS_TIMEOUT)
-      {
-        sendACK(PKT_ERR_TOUT);
-        timeStart = 0;
-        state = ST_IDLE;
-      }
+      runAT();
+      return(false);
     }
 
-    // process the next character if there is one
-    if (BTChan->available())
+    // check for timeout if we are currently mid packet
+    if (_state != ST_IDLE && millis() - _timeStart >= BT_COMMS_TIMEOUT)
+      abortPacket(PKT_ERR_TOUT);
+
+    if (BTChan.overflow())
+      _rxOverflow++;
+
+    // process the waiting characters, up to the budget for one call
+    for (uint8_t i = 0; i < BT_RX_BUDGET && _cmdCount < BT_CMD_MAX && BTChan.available(); i++)
     {
-      char ch = BTChan->read();
+      _timeLastRx = millis();
+      parseChar(BTChan.read());
+    }
 
-      switch (state)
-      {
-      case ST_IDLE:		// waiting start character
-        if (ch == PKT_START)
-        {
-          PRINT("\nPkt Srt ", ch);
-          state = ST_CMD;
-          c.cmd = c.data = 0;
-          timeStart = millis();
-          countActual = 0;
-        }
-        break;
+    // acknowledge binary frames once there is nothing more waiting
+    if (_bAckPending && !BTChan.available())
+      sendBinACK(PKT_ERR_OK);
 
-      case ST_CMD:		// reading command
-        PRINT("\nPkt Cmd ", ch);
-        c.cmd = ch;
-        switch (ch)
-        {
-        case PKT_CMD_LAMPTEST:
-        case CMD_RESET:
-        case CMD_SETUP:
-          state = ST_END; 	// no data required
-          break;
-
-        case PKT_CMD_SELECT:
-        case PKT_CMD_VALUE:
-        case PKT_CMD_DEMO:
-        case PKT_CMD_CLKFACE:
-          countTarget = 1;
-          state = ST_DATA;	// needs data
-          break;
-
-        case PKT_CMD_BRIGHT:
-          countTarget = 3;
-          state = ST_DATA;
-          break;
-
-        case PKT_CMD_TIME:
-          countTarget = 6;
-          state = ST_DATA;
-          break;
-
-        default:
-          sendACK(PKT_ERR_CMD);
-          state = ST_IDLE;
-          break;
-        }
-        break;
+    // return the next command received
+    if (_cmdCount == 0)
+      return(false);
 
-      case ST_DATA:		// reading data
-        PRINT("\nPkt cBuf[", countActual);
-        cBuf[countActual++] = ch;
-        PRINT("]:", cBuf[countActual-1]);
+    c = _cmdBuf[_cmdTail];
+    _cmdTail = (_cmdTail + 1) & (BT_CMD_MAX - 1);
+    _cmdCount--;
 
-        if (countActual >= countTarget) // we have it all!
-        {
-          PRINT(" done @", countActual);
-          state = ST_END;
-          switch (c.cmd)
-          {
-          case PKT_CMD_SELECT:
-            if (ch != CS_NEXT && ch != CS_PREV)
-              sendACK(PKT_ERR_DATA);
-            else
-            {
-              c.data = ch;
-              b = true;
-            }
-            break;
-
-          case PKT_CMD_VALUE:
-            if (ch != CV_DOWN && ch != CV_UP)
-              sendACK(PKT_ERR_DATA);
-            else
-            {
-              b = true;
-              c.data = ch;
-            }
-            break;
-
-          case PKT_CMD_DEMO:
-            if (ch != CD_OFF && ch != CD_CYCLE)
-              sendACK(PKT_ERR_DATA);
-            else
-            {
-              b = true;
-              c.data = ch;
-            }
-            break;
-
-          case PKT_CMD_CLKFACE:
-            if (ch != CC_CYCLE)
-              sendACK(PKT_ERR_DATA);
-            else
-            {
-              b = true;
-              c.data = ch;
-            }
-            break;
-
-          case PKT_CMD_BRIGHT:
-          {
-            uint16_t v = 0;
-
-            // countTarget digits 
-            for (uint8_t i = 0; i < countTarget; i++)
-              v = (v * 10) + (cBuf[i] - '0');
-
-            if (v > 255) v = 255;
-            c.data = v;
-            b = true;
-          }
-          break;
-
-          case PKT_CMD_TIME:
-          {
-            uint8_t v[3] = { 0 };
-
-            // split into digits 
-            for (uint8_t i = 0; i < countTarget; i += 2)
-              v[i / 2] = ((cBuf[i] - '0') * 10) + (cBuf[i + 1] - '0');
-
-            // sanity check and error or good data 
-            if (v[0] > 12 || v[1] > 59 || v[2] > 59) // hours, minutes, seconds
-              sendACK(PKT_ERR_DATA);
-            else // pack the time into the data field
-            {
-              b = true;
-              for (uint8_t i = 0; i < countTarget / 2; i++)
-                c.data = (c.data << 8) + v[i];
-            }
-          }
-          break;
-
-          default:
-            sendACK(PKT_ERR_CMD);
-            break;
-          }
-          state = (b ? ST_END : ST_IDLE);
-          b = false; // reset the status for return value
-        }
-        break;
+    return(true);
+  }
 
-      case ST_END:		// reading stop character
-        PRINT("\nPkt End ", ch);
-        b = (ch == PKT_END);
-        state = ST_IDLE;
-        sendACK(b ? PKT_ERR_OK : PKT_ERR_SEQ);
-        break;
+  inline bool isTxIdle(void) { return(_txHead == _txTail); }   // nothing waiting to be sent
+  inline uint8_t getTxHighWater(void) { return(_txHighWater); }
+  inline uint16_t getTxOverflow(void) { return(_txOverflow); }
+  inline uint16_t getRxOverflow(void) { return(_rxOverflow); }
+  inline uint16_t getRxDropped(void) { return(_rxDropped); }
+  inline uint16_t getPktErrors(void) { return(_pktErrors); }
 
-      default:	// something screwed up - reset the FSM
-        state = ST_IDLE;
-        sendACK(PKT_ERR_SEQ);
-        break;
-      }
+  // AT initialisation progress
+  inline bool isReady(void) { return(_atState == AT_DONE); }
+  inline uint8_t getATCount(void) { return(_atStep); }   // AT commands sent
+  inline uint8_t getATResult(uint8_t i) { return(i < BT_AT_MAX ? _atResult[i] : AT_NONE); }
+
+  bool isBusy(void)
+  // Returns true if characters are being received
+  {
+    if (BTChan.available())
+      return(true);
+
+    return(_timeLastRx != 0 && millis() - _timeLastRx < BT_BUSY_TIME);
+  }
+
+#if REPLAY_TRACE
+  bool inject(char ch)
+  // Replay a character as if it was received.
+  // Returns false if the command queue is full and the character was not used.
+  {
+    if (_cmdCount >= BT_CMD_MAX)
+      return(false);
+
+    _timeLastRx = millis();
+    parseChar(ch);
+    return(true);
+  }
+#endif
+
+  bool sendData(char cmd, uint8_t id, const void *data, uint8_t len)
+  // Send a binary data frame to the BT master through the transmit queue.
+  // The whole frame is queued or, if there is no room, it is dropped.
+  {
+    uint8_t hdr[4] = { PKT_BIN_START, (uint8_t)cmd, id, len };
+    uint8_t crc = 0;
+
+    if (txCount() + len + sizeof(hdr) + 1 >= BT_TX_SIZE)
+    {
+      _txOverflow++;
+      return(false);
     }
-  
-    return(b);
+
+    for (uint8_t i = 1; i < sizeof(hdr); i++)
+      crc = crc8(crc, hdr[i]);
+    for (uint8_t i = 0; i < len; i++)
+      crc = crc8(crc, ((const uint8_t *)data)[i]);
+
+    txPut(hdr, sizeof(hdr));
+    txPut((const uint8_t *)data, len);
+    txPut(&crc, 1);
+
+    return(true);
   }
 
 private:
   // Serial interface parameters
   uint8_t _pinRecv, _pinSend;
-  uint8_t _cmdIdx;   // char index for getting AT command from PROGMEM
+  uint8_t _atIdx;    // char index for getting AT command from PROGMEM
   const char *_szBTName;  // BT name
+  uint32_t _timeLastRx;   // time the last character was received
+
+  // AT initialisation
+  enum { AT_SETUP, AT_SEND, AT_DRAIN, AT_RESP, AT_DONE } _atState;
+  uint8_t  _atStep;       // AT command being processed
+  bool     _atLast;       // this is the last AT command
+  uint32_t _timeAT;       // time the current AT state started
+  uint8_t  _atRespLen;    // response length
+  uint8_t  _atResult[BT_AT_MAX]; // AT_* result for each command
+
+  // Packet parser
+  enum { ST_IDLE, ST_CMD, ST_DATA, ST_END, ST_BIN_SEQ, ST_BIN_LEN, ST_BIN_DATA, ST_BIN_CRC } _state;
+  uint32_t _timeStart;    // time the current packet started
+  uint8_t _countTarget, _countActual; // data characters expected and received
+  uint8_t _countPkt;      // characters received in the current packet
+  union                   // no packets are parsed until the AT commands are done
+  {
+    char  _cBuf[BT_BIN_MAX];    // packet data
+    char  _atResp[BT_AT_RESP];  // AT response received
+  };
+  cmdQ_t  _cq;            // command being received
+  uint16_t _rxOverflow;   // serial receive buffer overflows
+  uint16_t _rxDropped;    // characters discarded
+  uint16_t _pktErrors;    // packets rejected with an error response
+
+  // Received commands waiting for getCommand()
+  cmdQ_t  _cmdBuf[BT_CMD_MAX];
+  uint8_t _cmdTail, _cmdCount; // next command to return and number waiting
+
+  // Binary protocol
+  uint8_t _binSeq;        // sequence number of the last good frame
+  uint8_t _binSeqRx;      // sequence number of the frame being received
+  uint8_t _crc;           // running CRC of the frame being received
+  bool    _bAckPending;   // good frame(s) waiting to be acknowledged
+
+  // Transmit queue
+  uint8_t _txBuf[BT_TX_SIZE];
+  uint8_t _txHead, _txTail; // next free and next to send
+  uint8_t _txHighWater;   // most characters queued at once
+  uint16_t _txOverflow;   // responses dropped as the queue was full
 #if USE_ALTSOFTSERIAL
-  AltSoftSerial *BTChan;
+  AltSoftSerial BTChan;   // fixed pins, see the library
 #else
-  SoftwareSerial *BTChan;
+  SoftwareSerial BTChan;
 #endif
 
   // Functions
@@ -374,47 +418,594 @@ private:
   // The first call should reset the index counter
   // Return true if this is the last command
   {
-    if (fReset) _cmdIdx = 0;
+    if (fReset) _atIdx = 0;
 
-    strncpy_P(szBuf, ATCmd+_cmdIdx, lenBuf);
-    _cmdIdx += (strlen_P(ATCmd + _cmdIdx) + 1);
+    strncpy_P(szBuf, ATCmd+_atIdx, lenBuf);
+    _atIdx += (strlen_P(ATCmd + _atIdx) + 1);
 
-    return(pgm_read_byte(ATCmd + _cmdIdx) == '\0');
+    return(pgm_read_byte(ATCmd + _atIdx) == '\0');
   }
 
-  bool getATResponse(char* resp, uint8_t lenBuf)
-  // Get an AT response from the BT module or time out waiting
+  void runAT(void)
+  // Advance the AT initialisation state machine.
+  // Each command is queued for transmission, then the response is 
+  // collected until the end of line, a gap in the response or timeout.
   {
-    const uint16_t RESP_TIMEOUT = 500;
+    // anything received outside a response is not for us
+    if (_atState != AT_RESP)
+    {
+      while (BTChan.available())
+      {
+        BTChan.read();
+        _timeLastRx = millis();
+        _rxDropped++;
+      }
+    }
+
+    switch (_atState)
+    {
+    case AT_SETUP:  // HC05 setup mode pulse
+      if (millis() - _timeAT < AT_SETUP_TIME)
+        break;
+#if HW_USE_HC05
+      digitalWrite(HC05_SETUP_ENABLE, LOW);
+#endif
+      _atState = AT_SEND;
+      break;
+
+    case AT_SEND:   // queue the next command
+    {
+      char szCmd[20];
+      uint8_t len;
+
+      if (txCount() != 0)
+        break;
+
+      // Queue the preamble, AT command, end of line.
+      // First item is always the name!
+      _atLast = getATCmd(szCmd, ARRAY_SIZE(szCmd), (_atStep == 0));
+      PRINT("\nBT AT ", szCmd);
+      len = strlen(szStart) + strlen(szCmd) + strlen(szEnd);
+      if (_atStep == 0) len += strlen(_szBTName);
+      if (len >= BT_TX_SIZE)
+      {
+        _atResult[_atStep] = AT_ERR;
+        _atState = AT_DONE;
+        break;
+      }
+
+      txPut((uint8_t *)szStart, strlen(szStart));
+      txPut((uint8_t *)szCmd, strlen(szCmd));
+      if (_atStep == 0)  // first item - insert the name
+        txPut((uint8_t *)_szBTName, strlen(_szBTName));
+      txPut((uint8_t *)szEnd, strlen(szEnd));
+      _atResult[_atStep] = AT_SENT;
+      _atState = AT_DRAIN;
+    }
+    break;
+
+    case AT_DRAIN:  // wait for the command to be sent
+      if (txCount() != 0)
+        break;
+
+      if (_atLast)
+      {
+        // don't care about the last response as normally a RESET
+        _atStep++;
+        _atState = AT_DONE;
+        PRINTS("\nBT init done");
+      }
+      else
+      {
+        _atRespLen = 0;
+        _atResp[0] = '\0';
+        _timeAT = millis();
+        _atState = AT_RESP;
+      }
+      break;
+
+    case AT_RESP:   // collect the response
+    {
+      bool bEnd = false;
+
+      while (!bEnd && BTChan.available())
+      {
+        char c = BTChan.read();
+
+        _timeLastRx = millis();
+        _atResp[_atRespLen++] = c;
+        _atResp[_atRespLen] = '\0';
+        bEnd = (c == '\n' || _atRespLen >= BT_AT_RESP - 1);
+      }
+
+      if (bEnd || 
+        (_atRespLen != 0 && millis() - _timeLastRx >= AT_RESP_GAP) ||
+        millis() - _timeAT >= AT_RESP_TIMEOUT)
+      {
+        if (_atRespLen == 0)
+          _atResult[_atStep] = AT_TOUT;
+        else if (strncmp(_atResp, "OK", 2) == 0)
+          _atResult[_atStep] = AT_OK;
+        else
+          _atResult[_atStep] = AT_ERR;
+        PRINT(" resp ", _atResp);
+        PRINT(" result ", _atResult[_atStep]);
+
+        if (_atStep < BT_AT_MAX - 1)
+        {
+          _atStep++;
+          _atState = AT_SEND;
+        }
+        else
+          _atState = AT_DONE;
+      }
+    }
+    break;
+
+    default:
+      _atState = AT_DONE;
+      break;
+    }
+  }
+
+  void cmdPut(cmdQ_t &cq)
+  // Add a received command to the queue for getCommand()
+  {
+    _cmdBuf[(_cmdTail + _cmdCount) & (BT_CMD_MAX - 1)] = cq;
+    _cmdCount++;
+  }
+
+  void abortPacket(char err)
+  // Send the error response and discard the packet being received
+  {
+    if (_state >= ST_BIN_SEQ)
+      sendBinACK(err);
+    else
+      sendACK(err);
+    _pktErrors++;
+    _rxDropped += _countPkt;
+    _state = ST_IDLE;
+  }
+
+  void parseChar(char ch)
+  // Run the packet FSM for the next character received
+  {
+    _countPkt++;
+
+    switch (_state)
+    {
+    case ST_IDLE:		// waiting start character
+      _countPkt = 1;
+      if (ch == PKT_START)
+      {
+        PRINT("\nPkt Srt ", ch);
+        _state = ST_CMD;
+        _cq.cmd = _cq.data = 0;
+        _timeStart = millis();
+        _countActual = 0;
+      }
+      else if ((uint8_t)ch == PKT_BIN_START)
+      {
+        PRINTS("\nBin Srt");
+        _state = ST_BIN_SEQ;
+        _timeStart = millis();
+        _countActual = 0;
+      }
+      else
+        _rxDropped++;
+      break;
+
+    case ST_BIN_SEQ:  // binary frame sequence number
+      _binSeqRx = ch;
+      _crc = crc8(0, _binSeqRx);
+      _state = ST_BIN_LEN;
+      break;
+
+    case ST_BIN_LEN:  // binary frame payload length
+      _countTarget = ch;
+      _crc = crc8(_crc, _countTarget);
+      if (_countTarget == 0 || _countTarget > BT_BIN_MAX)
+        abortPacket(PKT_ERR_DATA);
+      else
+        _state = ST_BIN_DATA;
+      break;
+
+    case ST_BIN_DATA: // binary frame payload
+      _cBuf[_countActual++] = ch;
+      _crc = crc8(_crc, ch);
+      if (_countActual >= _countTarget)
+        _state = ST_BIN_CRC;
+      break;
+
+    case ST_BIN_CRC:  // check and process the frame
+    {
+      char err;
+
+      PRINTX("\nBin Seq ", _binSeqRx);
+      if ((uint8_t)ch != _crc)
+        err = PKT_ERR_DATA;
+      else if (_binSeqRx != 0 && _binSeqRx != (uint8_t)(_binSeq + 1))
+        err = PKT_ERR_SEQ;
+      else
+        err = parseBinary((uint8_t *)_cBuf, _countTarget);
+
+      if (err != PKT_ERR_OK)
+      {
+        PRINT(" err ", err);
+        abortPacket(err);
+      }
+      else
+      {
+        _binSeq = _binSeqRx;
+        _bAckPending = true;
+        _state = ST_IDLE;
+      }
+    }
+    break;
+
+    case ST_CMD:		// reading command
+      PRINT("\nPkt Cmd ", ch);
+      _cq.cmd = ch;
+      switch (ch)
+      {
+      case PKT_CMD_LAMPTEST:
+      case CMD_RESET:
+      case CMD_SETUP:
+        _state = ST_END; 	// no data required
+        break;
 
-    uint32_t timeStart = millis();
-    char c = '\0';
-    uint8_t len = 0;
+      case PKT_CMD_SELECT:
+      case PKT_CMD_VALUE:
+      case PKT_CMD_DEMO:
+      case PKT_CMD_CLKFACE:
+      case PKT_CMD_IRMODE:
+      case PKT_CMD_DIAG:
+      case PKT_CMD_THEME:
+      case PKT_CMD_QUERY:
+        _countTarget = 1;
+        _state = ST_DATA;	// needs data
+        break;
+
+      case PKT_CMD_BRIGHT:
+        _countTarget = 3;
+        _state = ST_DATA;
+        break;
+
+      case PKT_CMD_TIME:
+        _countTarget = 6;
+        _state = ST_DATA;
+        break;
+
+      case PKT_CMD_COLOUR:
+      case PKT_CMD_ECHO:
+        _countTarget = 8;
+        _state = ST_DATA;
+        break;
 
-    *resp = '\0';
-    while ((millis() - timeStart < RESP_TIMEOUT) && (c != '\n') && (len < lenBuf))
+      case PKT_CMD_SYNC:
+        _countTarget = 9;
+        _state = ST_DATA;
+        break;
+
+      default:
+        abortPacket(PKT_ERR_CMD);
+        break;
+      }
+      break;
+
+    case ST_DATA:		// reading data
     {
-      if (BTChan->available())
+      bool b = false;
+
+      PRINT("\nPkt cBuf[", _countActual);
+      _cBuf[_countActual++] = ch;
+      PRINT("]:", _cBuf[_countActual-1]);
+
+      if (_countActual < _countTarget)
+        break;
+
+      // we have it all!
+      PRINT(" done @", _countActual);
+      switch (_cq.cmd)
+      {
+      case PKT_CMD_SELECT:
+        b = (ch == CS_NEXT || ch == CS_PREV);
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_VALUE:
+        b = (ch == CV_DOWN || ch == CV_UP);
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_DEMO:
+        b = (ch == CD_OFF || ch == CD_CYCLE);
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_CLKFACE:
+        b = (ch == CC_CYCLE || (ch >= '0' && ch < '0' + CLKFACE_COUNT));
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_IRMODE:
+        b = (isdigit(ch) || ch == CI_LEARN);
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_DIAG:
+        b = isdigit(ch);   // page number
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_THEME:
+        b = isdigit(ch);   // theme number or CT_USER
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_QUERY:
+        b = (ch >= CQ_STATE && ch <= CQ_QUIET);
+        _cq.data = ch;
+        break;
+
+      case PKT_CMD_COLOUR:
+      case PKT_CMD_ECHO:
+        // countTarget hex digits
+        b = true;
+        for (uint8_t i = 0; i < _countTarget; i++)
+        {
+          b = b && isxdigit(_cBuf[i]);
+          _cq.data = (_cq.data << 4) + (isdigit(_cBuf[i]) ? _cBuf[i] - '0' : (toupper(_cBuf[i]) - 'A' + 10));
+        }
+        if (_cq.cmd == PKT_CMD_COLOUR)
+          b = b && (_cq.data >> 24) < PAL_COUNT;
+        break;
+
+      case PKT_CMD_BRIGHT:
+      {
+        uint16_t v = 0;
+
+        // countTarget digits 
+        for (uint8_t i = 0; i < _countTarget; i++)
+          v = (v * 10) + (_cBuf[i] - '0');
+
+        if (v > 255) v = 255;
+        _cq.data = v;
+        b = true;
+      }
+      break;
+
+      case PKT_CMD_TIME:
+      {
+        uint8_t v[3] = { 0 };
+
+        // split into digits 
+        for (uint8_t i = 0; i < _countTarget; i += 2)
+          v[i / 2] = ((_cBuf[i] - '0') * 10) + (_cBuf[i + 1] - '0');
+
+        // sanity check and error or good data 
+        b = (v[0] <= 23 && v[1] <= 59 && v[2] <= 59); // hours, minutes, seconds
+        for (uint8_t i = 0; i < _countTarget / 2; i++) // pack the time into the data field
+          _cq.data = (_cq.data << 8) + v[i];
+      }
+      break;
+
+      case PKT_CMD_SYNC:
       {
-        c = BTChan->read();
-        *resp++ = c;
-        *resp = '\0';
-        len++;
+        uint8_t v[3] = { 0 };
+        uint16_t ms = 0;
+
+        // split into digits, HHMMSS then mmm
+        b = true;
+        for (uint8_t i = 0; i < _countTarget; i++)
+          b = b && isdigit(_cBuf[i]);
+        for (uint8_t i = 0; i < 6; i += 2)
+          v[i / 2] = ((_cBuf[i] - '0') * 10) + (_cBuf[i + 1] - '0');
+        for (uint8_t i = 6; i < _countTarget; i++)
+          ms = (ms * 10) + (_cBuf[i] - '0');
+
+        // sanity check and pack the ms of the day into the data field
+        b = b && (v[0] <= 23 && v[1] <= 59 && v[2] <= 59);
+        _cq.data = ((((v[0] * 60UL) + v[1]) * 60) + v[2]) * 1000 + ms;
       }
+      break;
+      }
+
+      if (b)
+        _state = ST_END;
+      else
+        abortPacket(PKT_ERR_DATA);
     }
+    break;
+
+    case ST_END:		// reading stop character
+      PRINT("\nPkt End ", ch);
+      if (ch == PKT_END)
+      {
+        if (!txRoom(BT_ACK_SIZE + replySize(_cq)))
+          abortPacket(PKT_ERR_FULL);  // no room for the reply - master should resend
+        else
+        {
+          cmdPut(_cq);
+          sendACK(PKT_ERR_OK);
+          _state = ST_IDLE;
+        }
+      }
+      else
+        abortPacket(PKT_ERR_SEQ);
+      break;
+
+    default:	// something screwed up - reset the FSM
+      abortPacket(PKT_ERR_SEQ);
+      break;
+    }
+  }
+
+  uint8_t crc8(uint8_t crc, uint8_t data)
+  // Add data to the running CRC-8 (polynomial x^8 + x^2 + x + 1)
+  {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+
+    return(crc);
+  }
+
+  char parseBinCmd(const uint8_t *buf, uint8_t len, uint8_t &i, cmdQ_t &cq)
+  // Unpack and check the binary command at buf[i] into cq, moving i past it.
+  // Returns PKT_ERR_OK if the command is valid.
+  {
+    uint8_t countData;
+    bool bValid;
+
+    cq.cmd = buf[i++];
+    switch (cq.cmd)
+    {
+    case PKT_CMD_LAMPTEST:
+    case PKT_CMD_RESET:
+    case PKT_CMD_SETUP:   countData = 0; break;
+    case PKT_CMD_SELECT:
+    case PKT_CMD_VALUE:
+    case PKT_CMD_DEMO:
+    case PKT_CMD_CLKFACE:
+    case PKT_CMD_IRMODE:
+    case PKT_CMD_DIAG:
+    case PKT_CMD_THEME:
+    case PKT_CMD_QUERY:
+    case PKT_CMD_BRIGHT:  countData = 1; break;
+    case PKT_CMD_TIME:    countData = 3; break;
+    case PKT_CMD_COLOUR:
+    case PKT_CMD_ECHO:
+    case PKT_CMD_SYNC:    countData = 4; break;
+    default:  return(PKT_ERR_CMD);
+    }
+    if (i + countData > len)
+      return(PKT_ERR_DATA);
+
+    // pack the data MSB first, same as the ASCII packets
+    cq.data = 0;
+    for (uint8_t j = 0; j < countData; j++)
+      cq.data = (cq.data << 8) + buf[i++];
+
+    switch (cq.cmd)
+    {
+    case PKT_CMD_SELECT:  bValid = (cq.data == CS_NEXT || cq.data == CS_PREV); break;
+    case PKT_CMD_VALUE:   bValid = (cq.data == CV_DOWN || cq.data == CV_UP);   break;
+    case PKT_CMD_DEMO:    bValid = (cq.data == CD_OFF || cq.data == CD_CYCLE); break;
+    case PKT_CMD_CLKFACE: bValid = (cq.data == CC_CYCLE || (cq.data >= '0' && cq.data < '0' + CLKFACE_COUNT)); break;
+    case PKT_CMD_IRMODE:  bValid = (isdigit(cq.data) || cq.data == CI_LEARN); break;
+    case PKT_CMD_DIAG:    bValid = isdigit(cq.data); break;
+    case PKT_CMD_THEME:   bValid = isdigit(cq.data); break;
+    case PKT_CMD_QUERY:   bValid = (cq.data >= CQ_STATE && cq.data <= CQ_QUIET); break;
+    case PKT_CMD_COLOUR:  bValid = ((cq.data >> 24) < PAL_COUNT); break;
+    case PKT_CMD_SYNC:    bValid = (cq.data < 86400000UL); break;
+    case PKT_CMD_TIME:    bValid = ((cq.data >> 16) <= 23 && ((cq.data >> 8) & 0xff) <= 59 && (cq.data & 0xff) <= 59); break;
+    default:              bValid = true; break;
+    }
+
+    return(bValid ? PKT_ERR_OK : PKT_ERR_DATA);
+  }
+
+  char parseBinary(uint8_t *buf, uint8_t len)
+  // Unpack the commands in a binary frame payload into the command queue.
+  // The whole frame is checked before any command is queued, so they are
+  // only added if they are all valid and fit in the queue.
+  // Returns PKT_ERR_OK if all the commands were added.
+  {
+    cmdQ_t cq;
+    uint8_t i, count = 0, reply = BT_ACK_SIZE;
+    char err;
+
+    for (i = 0; i < len; count++)
+    {
+      err = parseBinCmd(buf, len, i, cq);
+      if (err != PKT_ERR_OK)
+        return(err);
+      reply += replySize(cq);
+    }
+    if (_cmdCount + count > BT_CMD_MAX || !txRoom(reply))
+      return(PKT_ERR_FULL);   // no room - master should resend
+
+    // all valid, queue them
+    for (i = 0; i < len; )
+    {
+      parseBinCmd(buf, len, i, cq);
+      cmdPut(cq);
+    }
+
+    return(PKT_ERR_OK);
+  }
+
+  uint8_t txCount(void) { return((_txHead - _txTail) & (BT_TX_SIZE - 1)); }
+  inline bool txRoom(uint8_t len) { return(txCount() + len < BT_TX_SIZE); }
+
+  uint8_t replySize(const cmdQ_t &cq)
+  // Transmit queue room needed for the data frame returned by cq, so that
+  // a request is only acknowledged if its reply can be sent
+  {
+    if (cq.cmd == PKT_CMD_QUERY && cq.data != CQ_QUIET)
+      return(BT_STATE_MAX + 5);   // header, state fields and CRC
+    if (cq.cmd == PKT_CMD_SYNC)
+      return(BT_SYNC_SIZE + 5);
+    return(0);
+  }
+
+  bool txPut(const uint8_t *msg, uint8_t len)
+  // Queue a whole message for transmission, or drop it if there is no room
+  {
+    uint8_t count = txCount();
+
+    if (count + len >= BT_TX_SIZE)
+    {
+      _txOverflow++;
+      return(false);
+    }
+
+    for (uint8_t i = 0; i < len; i++)
+    {
+      _txBuf[_txHead] = msg[i];
+      _txHead = (_txHead + 1) & (BT_TX_SIZE - 1);
+    }
+
+    if (count + len > _txHighWater)
+      _txHighWater = count + len;
+
+    return(true);
+  }
+
+  void txDrain(void)
+  // Send some queued characters without waiting on the serial link
+  {
+#if USE_ALTSOFTSERIAL
+    for (uint8_t i = 0; i < BT_TX_BURST && _txTail != _txHead; i++)
+#else
+    if (_txTail != _txHead && !isBusy())
+#endif
+    {
+      BTChan.write(_txBuf[_txTail]);
+      _txTail = (_txTail + 1) & (BT_TX_SIZE - 1);
+    }
+  }
+
+  void sendBinACK(char resp)
+  // Send a binary protocol ACK to the BT master
+  {
+    uint8_t msg[5] = { PKT_BIN_START, PKT_CMD_ACK, _binSeq, (uint8_t)resp, 0 };
 
-    return(len != '\0');
+    msg[4] = crc8(crc8(crc8(0, msg[1]), msg[2]), msg[3]);
+    PRINT("\nBin Resp: ", resp);
+    txPut(msg, sizeof(msg));
+    _bAckPending = false;
   }
 
   void sendACK(char resp)
   // Send a protocol ACK to the BT master
   {
-    static char msg[] = { PKT_START, PKT_CMD_ACK, PKT_ERR_OK, PKT_END, '\n', '\0' };
+    uint8_t msg[] = { PKT_START, PKT_CMD_ACK, PKT_ERR_OK, PKT_END, '\n' };
 
     msg[2] = resp;
-    PRINT("\nResp: ", msg);
-    BTChan->print(msg);
-    BTChan->flush();
+    PRINT("\nResp: ", (char)resp);
+    txPut(msg, sizeof(msg));
   }
 
 };
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Effect scheduler class
+
+The effect scheduler owns the frame clock for the light demo effects.
+Effects are described by a table of descriptors in PROGMEM, each with
+init, step and teardown hooks (init and teardown may be nullptr):
+- init() is called once when the effect is started.
+- step() renders the next frame into the LED buffer. It must not do any
+  timing of its own - one call is one frame period of effect time.
+  The scheduled time of the frame being rendered is available from time(),
+  and its time since the effect started from elapsed().
+- teardown() is called when the effect is stopped or replaced.
+
+Frames are scheduled on a fixed time grid of one period. If run() is
+called late, the missed frames are stepped to catch up (up to
+FX_MAX_CATCHUP extra steps) and any further frames are dropped by moving
+the grid forward. The effect always advances by whole frames on the grid,
+so its output depends on the frame times, not on when run() was called.
+This only holds if step() takes its time from elapsed() rather than
+millis() (eg, for beat functions), and if any random numbers come from a
+generator seeded in init(). run() returns true when there is a new frame
+to send to the LEDs.
+
+With PROFILE_DEBUG set in Chroniker.h, frame pacing statistics are kept
+for the current effect and printed with the debug output when it stops:
+the min, average and maximum interval between rendered frames and the
+average deviation from the frame period (jitter), all in microseconds,
+plus the number of frames stepped to catch up and frames dropped. The
+statistics restart every FX_STATS_FRAMES frames.
+*/
+
+const uint8_t FX_MAX_CATCHUP = 2;       // max extra frames stepped to catch up
+const uint16_t FX_STATS_FRAMES = 32768; // statistics restart after this many frames
+
+// Effect descriptor
+typedef struct
+{
+  void (*init)(void);       // start the effect
+  void (*step)(void);       // render the next frame
+  void (*teardown)(void);   // stop the effect
+} fxEffect_t;
+
+class FXScheduler
+{
+public:
+  // Functions
+  FXScheduler(uint16_t period) : _period(period), _bActive(false)
+  {
+#if PROFILE_DEBUG
+    resetStats();
+#endif
+  };
+
+  void start(const fxEffect_t *fx)
+  // Start the effect described by the PROGMEM descriptor fx
+  {
+    stop();
+    memcpy_P(&_fx, fx, sizeof(_fx));
+#if PROFILE_DEBUG
+    resetStats();
+#endif
+    _timeStart = _timeNext = _time = millis();
+    if (_fx.init != nullptr) _fx.init();
+    _bActive = true;
+  }
+
+  void stop(void)
+  // Stop the current effect, if there is one
+  {
+    if (!_bActive) return;
+
+#if PROFILE_DEBUG
+    PRINT("\nFX frames:", _frames);
+    PRINT(" min:", _intervalMin);
+    PRINT(" avg:", getIntervalAvg());
+    PRINT(" max:", _intervalMax);
+    PRINT(" jitter:", getJitter());
+    PRINT(" catchup:", _catchup);
+    PRINT(" dropped:", _dropped);
+#endif
+
+    if (_fx.teardown != nullptr) _fx.teardown();
+    _bActive = false;
+  }
+
+  bool run(void)
+  // Step the effect for all frames that are due.
+  // Returns true if there is a new frame in the LED buffer.
+  {
+    uint32_t now = millis();
+    uint8_t steps = 0;
+
+    if (!_bActive || (int32_t)(now - _timeNext) < 0)
+      return(false);
+
+    // frame due plus any catch up
+    do
+    {
+      step();
+      steps++;
+    } while ((int32_t)(now - _timeNext) >= 0 && steps <= FX_MAX_CATCHUP);
+#if PROFILE_DEBUG
+    _catchup += steps - 1;
+#endif
+
+    // drop anything still outstanding
+    if ((int32_t)(now - _timeNext) >= 0)
+    {
+      uint32_t late = ((now - _timeNext) / _period) + 1;
+
+#if PROFILE_DEBUG
+      _dropped += late;
+#endif
+      _timeNext += late * _period;
+    }
+
+#if PROFILE_DEBUG
+    updateStats();
+#endif
+    return(true);
+  }
+
+  void step(void)
+  // Render the next frame on the grid, regardless of the time now
+  {
+    _time = _timeNext;
+    _fx.step();
+    _timeNext += _period;
+  }
+
+  inline bool isActive(void) { return(_bActive); }
+  inline uint32_t time(void) { return(_time); }   // scheduled time (ms) of the current frame
+  inline uint32_t elapsed(void) { return(_time - _timeStart); }  // effect time (ms) of the current frame
+  inline uint16_t getPeriod(void) { return(_period); }
+  inline void setPeriod(uint16_t period) { _period = period; }
+
+#if PROFILE_DEBUG
+  // Frame pacing statistics
+  inline uint32_t getFrames(void) { return(_frames); }
+  inline uint32_t getIntervalMin(void) { return(_intervalMin); }
+  inline uint32_t getIntervalMax(void) { return(_intervalMax); }
+  inline uint32_t getIntervalAvg(void) { return(_frames > 1 ? _intervalSum / (_frames - 1) : 0); }
+  inline uint32_t getJitter(void) { return(_frames > 1 ? _jitterSum / (_frames - 1) : 0); }
+  inline uint32_t getCatchup(void) { return(_catchup); }
+  inline uint32_t getDropped(void) { return(_dropped); }
+
+  void resetStats(void)
+  {
+    _frames = _catchup = _dropped = 0;
+    _intervalSum = _jitterSum = _intervalMax = 0;
+    _intervalMin = 0xffffffff;
+  }
+#endif
+
+private:
+  fxEffect_t _fx;       // current effect
+  uint16_t _period;     // frame period (ms)
+  bool     _bActive;    // effect is running
+  uint32_t _timeStart;  // time the effect was started (ms)
+  uint32_t _time;       // scheduled time of the current frame (ms)
+  uint32_t _timeNext;   // scheduled time of the next frame (ms)
+
+#if PROFILE_DEBUG
+  // statistics
+  uint32_t _timeLast;   // time the last frame was rendered (us)
+  uint32_t _frames;     // frames rendered
+  uint32_t _catchup;    // extra frames stepped to catch up
+  uint32_t _dropped;    // frames dropped
+  uint32_t _intervalMin, _intervalMax, _intervalSum; // frame intervals (us)
+  uint32_t _jitterSum;  // sum of deviation from the frame period (us)
+
+  void updateStats(void)
+  // Add the interval since the last frame to the pacing statistics
+  {
+    uint32_t now = micros();
+
+    if (_frames >= FX_STATS_FRAMES)   // keep the sums in range
+      resetStats();
+
+    if (_frames != 0)
+    {
+      uint32_t interval = now - _timeLast;
+      uint32_t target = (uint32_t)_period * 1000;
+
+      if (interval < _intervalMin) _intervalMin = interval;
+      if (interval > _intervalMax) _intervalMax = interval;
+      _intervalSum += interval;
+      _jitterSum += (interval > target ? interval - target : target - interval);
+    }
+    _timeLast = now;
+    _frames++;
+  }
+#endif
+};
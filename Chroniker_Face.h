@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+#include "Chroniker_Theme.h"
+#include "Chroniker_Ring.h"
+
+/*
+Clock face definitions
+
+Each clock face is described by an entry in a table of face descriptors
+held in PROGMEM. A face is made up of
+- a static background layer (eg, hour marks) that is also in PROGMEM,
+  or nullptr for a blank background. The background is copied into the
+  pixel buffer in one block at the start of each frame.
+- a hand rendering kernel that draws the hands over the background. The
+  kernel is called once for each LED ring that shows any hands, with the
+  hand positions and geometry for that ring (see Chroniker_Ring.h).
+- the layer order for the hands. Hands are drawn in this order, so the
+  last hand in the list is on top when hands overlap.
+
+Faces draw palette entries (PAL_*) into the pixel buffer, not colours, 
+and the colours are applied from the theme when the frame is shown (see
+Chroniker_Theme.h). Background layers are built at compile time from the
+ring configuration, so changing this does not need any table edits.
+Adding a face only needs a new kernel (or reuse of an existing one) and
+a new entry in the face table in the main program.
+*/
+
+// Hand indices
+enum clkHand_e { HAND_H, HAND_M, HAND_S, HAND_COUNT };
+
+// Hand information passed to the rendering kernels
+typedef struct
+{
+  ringGeom_t ring;        // ring being drawn
+  uint8_t x[HAND_COUNT];  // LED for each hand on the ring
+  uint16_t unit[HAND_COUNT]; // dial position for each hand, 8.8 fixed point
+  uint8_t pal[HAND_COUNT]; // palette entry for each hand (PAL_OFF if blinked off)
+} clkHands_t;
+
+static_assert(RING_H == (1 << HAND_H) && RING_M == (1 << HAND_M) && RING_S == (1 << HAND_S), "RING_* hand bits must match clkHand_e");
+
+// Clock face descriptor
+typedef struct
+{
+  const uint8_t *bg;      // background layer in PROGMEM (pixel[NUM_LEDS]) or nullptr
+  void (*draw)(const clkHands_t &h, const uint8_t *layer); // hand rendering kernel
+  uint8_t layer[HAND_COUNT]; // hand drawing order, last one is on top
+} clkFace_t;
+
+// Hour marks background
+constexpr uint8_t bgMarkPal(uint16_t i, uint8_t r)
+// palette entry for LED i on ring r
+{
+  return(!(RING_SHOW[r] & RING_MARKS) ? PAL_OFF :
+         (((i - ringStart(r)) % (RING_SIZE[r] / 12) != 0) ? PAL_MMARK : 
+         (i == ringStart(r) ? PAL_12HMARK : PAL_HMARK)));
+}
+
+constexpr uint8_t bgMarkPixel(uint16_t i)
+// pixel buffer entry for LED i
+{
+  return(pixel(bgMarkPal(i, ringOf(i))));
+}
+
+template<typename S> struct bgMarks;
+template<uint16_t... I> struct bgMarks<idxSeq<I...>>
+{
+  static const uint8_t data[sizeof...(I)];
+};
+template<uint16_t... I> const uint8_t bgMarks<idxSeq<I...>>::data[sizeof...(I)] PROGMEM = { bgMarkPixel(I)... };
+
+typedef bgMarks<makeSeq<NUM_LEDS>::type> bgHourMarks;
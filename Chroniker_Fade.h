@@ -0,0 +1,103 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FastLED.h>
+#include "Chroniker.h"
+
+/*
+Crossfade transition class
+
+When the display changes mode (clock face, demo, setup) the change is
+crossfaded instead of cut. start() copies the frame being shown into a
+second frame buffer, and the LED hardware is switched to show that
+buffer. Whatever is drawn into the LED buffer after that is the new
+frame, and it is drawn in the normal way - the faces and demos do not
+know that a transition is running.
+
+run() is called every time through loop() and steps the transition on
+its own frame clock of FADE_PERIOD. Each step blends the new frame into
+the shown buffer with FastLED nblend() by 1/(steps left), so a still
+new frame is reached in a straight line over FADE_TIME, and a moving
+one (eg, a demo) is followed. At the last step the two buffers are the
+same and the hardware is switched back to the LED buffer. Starting a
+transition while one is running carries on from the frame being shown.
+
+The time taken by each blend is measured. The average and maximum for
+the last transition are printed with the debug output and kept for the
+render benchmark. A restarted transition starts its statistics again.
+*/
+
+class Crossfade
+{
+public:
+  // Functions
+  Crossfade(CRGB *led, uint8_t count, uint16_t period, uint8_t steps) :
+    _led(led), _count(count), _period(period), _steps(steps), _left(0),
+    _frames(0), _timeSum(0), _timeMax(0) {};
+
+  void start(void)
+  // Start a transition from the frame being shown
+  {
+    if (_steps == 0)
+      return;
+
+    if (_left == 0)
+    {
+      memcpy(_buf, _led, sizeof(_buf));
+      FastLED[0].setLeds(_buf, _count);
+    }
+    _frames = _timeSum = _timeMax = 0;
+    _left = _steps;
+    _timeNext = millis() + _period;
+  }
+
+  bool run(void)
+  // Blend the next step if it is due.
+  // Returns true if the shown buffer has changed.
+  {
+    uint32_t t;
+
+    if (_left == 0 || (int32_t)(millis() - _timeNext) < 0)
+      return(false);
+
+    _timeNext += _period;
+    t = micros();
+    nblend(_buf, _led, _count, _left == 1 ? 255 : 256 / _left);
+    t = micros() - t;
+
+    _frames++;
+    _timeSum += t;
+    if (t > _timeMax) _timeMax = t;
+
+    if (--_left == 0)
+    {
+      FastLED[0].setLeds(_led, _count);
+      PRINT("\nFade frames:", _frames);
+      PRINT(" avg us:", getTimeAvg());
+      PRINT(" max us:", _timeMax);
+    }
+
+    return(true);
+  }
+
+  inline bool isActive(void) { return(_left != 0); }
+  inline CRGB *getFrame(void) { return(_left != 0 ? _buf : _led); }   // frame being shown
+
+  // Blend cost for the last transition
+  inline uint16_t getTimeAvg(void) { return(_frames != 0 ? _timeSum / _frames : 0); }
+  inline uint16_t getTimeMax(void) { return(_timeMax); }
+
+private:
+  CRGB    *_led;        // LED buffer the frames are drawn in
+  CRGB    _buf[NUM_LEDS]; // frame buffer shown during the transition
+  uint8_t _count;       // number of LEDs
+  uint16_t _period;     // ms between steps
+  uint8_t _steps;       // steps in a transition
+  uint8_t _left;        // steps left in the current transition
+  uint32_t _timeNext;   // time the next step is due
+
+  // blend cost
+  uint16_t _frames;     // steps blended
+  uint32_t _timeSum;    // total blend time (us)
+  uint16_t _timeMax;    // longest blend time (us)
+};
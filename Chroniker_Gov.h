@@ -0,0 +1,127 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Frame rate governor class
+
+FastLED.show() disables interrupts while it runs, which corrupts IR frames
+and SoftwareSerial characters being received. The faster the demos and
+smooth clock face run, the more often this happens, so the frame rate is
+set at run time from the input activity:
+- GOV_IDLE - the inputs are quiet and frames are rendered every
+  GOV_PERIOD_IDLE ms.
+- GOV_BUSY - entered as soon as an IR edge or BT character is seen, and
+  frames are rendered every GOV_PERIOD_BUSY ms. The governor returns to
+  GOV_IDLE once the inputs have been quiet for GOV_IDLE_TIME ms.
+
+Statistics are kept for each mode - the time spent in the mode, the LED
+updates sent and the IR codes decoded and malformed (IR activity with no
+code) - so the achieved frame rate and its effect on IR reception can be
+compared and the periods tuned. The counters are cumulative values from
+the rest of the application and only the change is accounted to the mode.
+*/
+
+// Governor modes
+enum govMode_e { GOV_IDLE, GOV_BUSY, GOV_MODES };
+
+// Statistics for one mode, as sent to the BT master
+typedef struct
+{
+  uint32_t time;        // ms spent in the mode
+  uint32_t frames;      // LED updates sent
+  uint16_t irCodes;     // IR codes decoded
+  uint16_t irMalformed; // IR activity with no code decoded
+  uint16_t entries;     // times the mode was entered
+} govStats_t;
+
+class FrameGovernor
+{
+public:
+  // Functions
+  FrameGovernor(uint16_t periodIdle, uint16_t periodBusy, uint16_t idleTime) :
+    _period{ periodIdle, periodBusy }, _idleTime(idleTime), _mode(GOV_IDLE),
+    _frames(0), _irCodes(0), _irMalformed(0)
+  {
+    resetStats();
+  };
+
+  void begin(void)
+  // Start timing in the idle mode
+  {
+    _timeLast = _timeActive = millis();
+  }
+
+  bool run(bool bBusy, uint32_t frames, uint16_t irCodes, uint16_t irMalformed)
+  // Account the counters since the last call to the current mode and
+  // change mode for the input activity.
+  // Returns true if the frame period has changed.
+  {
+    uint32_t now = millis();
+    govStats_t *s = &_stats[_mode];
+    uint8_t mode = _mode;
+
+    s->time += now - _timeLast;
+    s->frames += frames - _frames;
+    s->irCodes += irCodes - _irCodes;
+    s->irMalformed += irMalformed - _irMalformed;
+    _timeLast = now;
+    _frames = frames;
+    _irCodes = irCodes;
+    _irMalformed = irMalformed;
+
+    if (bBusy)
+    {
+      _timeActive = now;
+      mode = GOV_BUSY;
+    }
+    else if (now - _timeActive >= _idleTime)
+      mode = GOV_IDLE;
+
+    if (mode == _mode)
+      return(false);
+
+    PRINT("\nGov mode ", mode);
+    _mode = mode;
+    _stats[_mode].entries++;
+    return(true);
+  }
+
+  inline uint8_t getMode(void) { return(_mode); }
+  inline uint16_t getPeriod(void) { return(_period[_mode]); }
+  inline const govStats_t *getStats(uint8_t mode) { return(&_stats[mode]); }
+
+  void resetStats(void)
+  {
+    memset(_stats, 0, sizeof(_stats));
+  }
+
+  void report(void)
+  // Print the statistics for each mode
+  {
+    for (uint8_t i = 0; i < GOV_MODES; i++)
+    {
+      PRINT("\nGov ", i);
+      PRINT(" ms:", _stats[i].time);
+      PRINT(" frames:", _stats[i].frames);
+      PRINT(" fps:", _stats[i].time != 0 ? (_stats[i].frames * 1000) / _stats[i].time : 0);
+      PRINT(" IR ok:", _stats[i].irCodes);
+      PRINT(" bad:", _stats[i].irMalformed);
+      PRINT(" entries:", _stats[i].entries);
+    }
+  }
+
+private:
+  uint16_t _period[GOV_MODES]; // frame period for each mode (ms)
+  uint16_t _idleTime;   // ms without input activity before GOV_IDLE
+  uint8_t  _mode;       // current mode
+  uint32_t _timeActive; // last time input activity was seen
+  uint32_t _timeLast;   // last time the counters were accounted
+  govStats_t _stats[GOV_MODES];
+
+  // counter values at the last call
+  uint32_t _frames;
+  uint16_t _irCodes;
+  uint16_t _irMalformed;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Arduino.h>
+#include <EEPROM.h>
 #include <IRReadOnlyRemote.h>
 #include "Chroniker.h"
 
@@ -8,106 +9,499 @@
 Infrared Remote class
 
 The IR Remote class implements the IR interface for Chroniker
-An IR keypress will be translated into commands based on a the static 
-translation table found in this class.
+An IR keypress will be translated into commands based on the key table for
+the remote profile selected. Digit keys accumulate a value that is used by
+the next command key that takes a value (eg, EQ sets brightness).
+Digits entered before the clock face key select that face directly,
+otherwise the key cycles through the faces.
+
+Remote profiles
+---------------
+Each key maps to one of the key functions in irFunc[]. The built-in
+profiles are tables of IR code and function held in PROGMEM, sorted by IR
+code so that a code is found with a binary search. The ordering is checked
+at compile time. Different remotes reuse the same codes for different keys,
+so only one profile is active at a time, selected with CMD_IRMODE.
+- IR_PROFILE_CARMP3 is the common 21 key 'Car MP3' NEC remote.
+- IR_PROFILE_KEYES is the 17 key Keyes NEC remote (arrows, OK, *, #, 0-9).
+- IR_PROFILE_LEARN is a set of codes learned from any remote.
+
+The profile in use is saved in EEPROM.
+
+Learn mode
+----------
+CMD_IRMODE CI_LEARN starts learn mode. The keys are then pressed on the
+remote in the order of the functions in irFunc[]. Each new code is saved
+in EEPROM against the next function. Pressing a key that is already
+learned skips the function, which is left unmapped, so remotes without a
+key for every function can still be used. Learn mode ends once all the 
+functions have a code or are skipped, or after IR_LEARN_TIMEOUT ms 
+without a key, when the functions not yet learned are left unmapped. The
+learned profile is then selected, unless no key was learned at all, when
+the previous profile is kept. The learned codes are saved in function
+order with an index table sorted by code for the binary search.
+
+Key repeat
+----------
+NEC remotes send a repeat code (0xFFFFFFFF) while a key is held down. If
+the last key was a CMD_VALUE command, the command is repeated after the key
+has been held for IR_RPT_DELAY ms, and then every IR_RPT_PERIOD ms.
+
+FastLED.show() disables interrupts and corrupts any IR frame being received.
+isBusy() polls the IR receiver output so that LED updates can be held back
+while a frame is arriving. The demodulated signal idles HIGH and pulses LOW,
+so any LOW level seen within IR_BUSY_TIME means a frame is in progress.
+Each burst of activity seen by isBusy() should end with a code (or repeat
+code) from the receiver library. Codes decoded and bursts that ended 
+without a code (malformed, usually corrupted by FastLED.show()) are 
+counted.
 */
 
+const uint16_t IR_BUSY_TIME = 20;  // ms after the last LOW level before IR is idle
+const uint16_t IR_FRAME_TIME = 68; // ms for a whole NEC frame (13.5ms leader + 32 bits)
+const uint16_t IR_RPT_DELAY = 400; // ms key held before CMD_VALUE repeats start
+const uint16_t IR_RPT_PERIOD = 150; // ms between CMD_VALUE repeats
+const uint16_t IR_RPT_TIMEOUT = 250; // ms without a repeat code that ends the key press
+const uint16_t IR_LEARN_TIMEOUT = 10000; // ms without a new key that ends learn mode
+
+const uint32_t IR_CODE_REPEAT = 0xFFFFFFFF;  // NEC repeat code
+const uint32_t IR_CODE_NONE = 0;             // no code - an unmapped function in the learned profile
+
+// Remote profiles
+enum irProfile_e { IR_PROFILE_CARMP3, IR_PROFILE_KEYES, IR_PROFILE_LEARN, IR_PROFILE_COUNT };
+
+// Key functions. This is also the order the keys are learned.
+typedef struct
+{
+  int8_t cmd;     // command or -1 for a digit
+  int8_t data;    // command data, -1 to use the accumulated value, or the digit value
+} irFunc_t;
+
+enum irFunc_e
+{
+  IRF_RESET, IRF_SETUP, IRF_LAMPTEST, IRF_CLKFACE, IRF_PREV, IRF_NEXT, IRF_BRIGHT,
+  IRF_DOWN, IRF_UP, IRF_DEMO, IRF_DEMO_OFF,
+  IRF_0, IRF_1, IRF_2, IRF_3, IRF_4, IRF_5, IRF_6, IRF_7, IRF_8, IRF_9,
+  IRF_COUNT
+};
+
+const irFunc_t PROGMEM irFunc[IRF_COUNT] =
+{
+  { CMD_RESET, 0 },
+  { CMD_SETUP, 0 },
+  { CMD_LAMPTEST, 0 },
+  { CMD_CLKFACE, CC_CYCLE },
+  { CMD_SELECT, CS_PREV },
+  { CMD_SELECT, CS_NEXT },
+  { CMD_BRIGHT, -1 },
+  { CMD_VALUE, CV_DOWN },
+  { CMD_VALUE, CV_UP },
+  { CMD_DEMO, CD_CYCLE },
+  { CMD_DEMO, CD_OFF },
+  { -1, 0 }, { -1, 1 }, { -1, 2 }, { -1, 3 }, { -1, 4 },
+  { -1, 5 }, { -1, 6 }, { -1, 7 }, { -1, 8 }, { -1, 9 },
+};
+
+// Profile key tables - MUST be sorted by IR code
+typedef struct
+{
+  uint32_t irCode;
+  uint8_t func;   // IRF_* function
+} irKey_t;
+
+constexpr irKey_t PROGMEM irCarMP3[] =
+{
+  { 0xFF02FD, IRF_PREV },     // |<<
+  { 0xFF10EF, IRF_4 },
+  { 0xFF18E7, IRF_2 },
+  { 0xFF22DD, IRF_CLKFACE },  // >||
+  { 0xFF30CF, IRF_1 },
+  { 0xFF38C7, IRF_5 },
+  { 0xFF42BD, IRF_7 },
+  { 0xFF4AB5, IRF_8 },
+  { 0xFF52AD, IRF_9 },
+  { 0xFF5AA5, IRF_6 },
+  { 0xFF629D, IRF_SETUP },    // Mode
+  { 0xFF6897, IRF_0 },
+  { 0xFF7A85, IRF_3 },
+  { 0xFF906F, IRF_UP },       // +
+  { 0xFF9867, IRF_DEMO },     // Shuffle
+  { 0xFFA25D, IRF_RESET },    // On/Off
+  { 0xFFA857, IRF_DOWN },     // -
+  { 0xFFB04F, IRF_DEMO_OFF }, // USD
+  { 0xFFC23D, IRF_NEXT },     // >>|
+  { 0xFFE01F, IRF_BRIGHT },   // EQ
+  { 0xFFE21D, IRF_LAMPTEST }, // Mute
+};
+
+constexpr irKey_t PROGMEM irKeyes[] =
+{
+  { 0xFF02FD, IRF_SETUP },    // OK
+  { 0xFF10EF, IRF_7 },
+  { 0xFF18E7, IRF_5 },
+  { 0xFF22DD, IRF_PREV },     // Left
+  { 0xFF30CF, IRF_4 },
+  { 0xFF38C7, IRF_8 },
+  { 0xFF42BD, IRF_CLKFACE },  // *
+  { 0xFF4AB5, IRF_0 },
+  { 0xFF52AD, IRF_BRIGHT },   // #
+  { 0xFF5AA5, IRF_9 },
+  { 0xFF629D, IRF_UP },       // Up
+  { 0xFF6897, IRF_1 },
+  { 0xFF7A85, IRF_6 },
+  { 0xFF9867, IRF_2 },
+  { 0xFFA857, IRF_DOWN },     // Down
+  { 0xFFB04F, IRF_3 },
+  { 0xFFC23D, IRF_NEXT },     // Right
+};
+
+constexpr bool irSorted(const irKey_t *t, uint8_t n)
+// true if the key table is in ascending IR code order
+{
+  return(n < 2 || (t[0].irCode < t[1].irCode && irSorted(t + 1, n - 1)));
+}
+
+static_assert(irSorted(irCarMP3, ARRAY_SIZE(irCarMP3)), "irCarMP3 must be sorted by IR code");
+static_assert(irSorted(irKeyes, ARRAY_SIZE(irKeyes)), "irKeyes must be sorted by IR code");
+
+// EEPROM layout for the IR block
+const uint16_t EE_IR_SIG = EE_IR_BASE;          // signature byte, EE_IR_SIGNATURE when valid
+const uint16_t EE_IR_PROFILE = EE_IR_BASE + 1;  // selected profile
+const uint16_t EE_IR_LEARNED = EE_IR_BASE + 2;  // IRF_COUNT when learned codes are valid
+const uint16_t EE_IR_CODES = EE_IR_BASE + 3;    // learned codes in function order
+const uint16_t EE_IR_INDEX = EE_IR_CODES + (IRF_COUNT * sizeof(uint32_t)); // function index sorted by code
+const uint8_t EE_IR_SIGNATURE = 0xa5;
+
+static_assert(EE_IR_INDEX + IRF_COUNT <= EE_IR_BASE + EE_IR_SIZE, "IR learned codes do not fit EEPROM block");
+
 class IRemote: public iChroniker
 {
 public:
   // Functions
-  IRemote(uint8_t irqPin)
+  IRemote(uint8_t irqPin) : _pinIR(irqPin), _timeActive(0), _profile(IR_PROFILE_CARMP3),
+    _accum(0), _bAccum(false), _rptFunc(IRF_COUNT), _bLearn(false),
+    _bBurst(false), _bDecoded(false), _irCodes(0), _irMalformed(0), _IR(irqPin)
   {
     c.cmd = c.data = 0;
-    _IR = new IRReadOnlyRemote(irqPin);
   };
 
-  ~IRemote() 
+  virtual void begin(void)
+  // Restore the remote profile saved in EEPROM
   {
-    delete _IR;
-  };
+    if (EEPROM.read(EE_IR_SIG) != EE_IR_SIGNATURE)
+    {
+      EEPROM.update(EE_IR_PROFILE, IR_PROFILE_CARMP3);
+      EEPROM.update(EE_IR_LEARNED, 0);
+      EEPROM.update(EE_IR_SIG, EE_IR_SIGNATURE);
+    }
+    setProfile(EEPROM.read(EE_IR_PROFILE));
+    PRINT("\nIR profile ", _profile);
+  }
 
   virtual bool getCommand(void)
     // Returns true if a keypress was processed and saved to public variables.
   {
     uint32_t irCode;
-    static uint16_t accum = 0;
+    uint8_t func;
 
     c.cmd = 0;
-    irCode = _IR->read();
+    irCode = _IR.read();
+#if REPLAY_TRACE
+    if (_irInject != 0)
+    {
+      irCode = _irInject;
+      _irInject = 0;
+    }
+#endif
 
-    // 'empty' or 'IR repeat' codes -> nothing to process
-    if (irCode == 0 || irCode == 0xFFFFFFFF)
+    if (irCode != 0)
+    {
+      _bDecoded = true;
+      _irCodes++;
+    }
+
+    if (_bLearn)
+    {
+      learnCode(irCode);
       return(false);
+    }
+
+    // key repeat
+    if (irCode == IR_CODE_REPEAT)
+    {
+      _timeRpt = millis();
+      return(false);
+    }
+    if (irCode == 0)
+      return(repeatCommand());
 
     PRINTX("\nIR: Rcv ", irCode);
 
-    // search the data table for a matching value
-    for (uint8_t i = 0; i < ARRAY_SIZE(IRCodes); i++)
+    func = findCode(irCode);
+    if (func >= IRF_COUNT)
+      return(false);
+
+    PRINT(" Func ", func);
+    setCommand(func);
+    _rptFunc = (c.cmd == CMD_VALUE ? func : IRF_COUNT);
+    _timeRpt = _timeNext = millis();
+    _timeNext += IR_RPT_DELAY;
+
+    return(c.cmd != 0);
+  }
+
+  bool isBusy(void)
+  // Returns true if an IR frame appears to be in progress
+  {
+    if (digitalRead(_pinIR) == LOW)
     {
-      if (IRCodes[i].irCode == irCode)
+      if (!_bBurst)   // start of a burst of activity
       {
-        PRINTX(" Matched ", IRCodes[i].irCode);
+        _bBurst = true;
+        _bDecoded = false;
+      }
+      _timeActive = millis();
+    }
 
-        if (IRCodes[i].cmd != -1)
-        {
-          // actual command
-          c.cmd = IRCodes[i].cmd;
-          if (IRCodes[i].data == -1)
-          {
-            c.data = accum;
-            accum = 0;    // reset value
-          }
-          else
-          {
-            c.data = IRCodes[i].data;
-          }
-        }
-        else // IRCodes[i].cmd == -1 -> accumulator value
+    if (_timeActive != 0 && millis() - _timeActive < IR_BUSY_TIME)
+      return(true);
+
+    if (_bBurst)      // end of the burst
+    {
+      _bBurst = false;
+      if (!_bDecoded) _irMalformed++;
+    }
+    return(false);
+  }
+
+  inline uint16_t getCodes(void) { return(_irCodes); }         // IR codes decoded
+  inline uint16_t getMalformed(void) { return(_irMalformed); } // IR bursts with no code
+
+  bool setProfile(uint8_t profile)
+  // Select the remote profile and save it in EEPROM.
+  // Returns false if the profile is not available.
+  {
+    if (profile >= IR_PROFILE_COUNT ||
+      (profile == IR_PROFILE_LEARN && EEPROM.read(EE_IR_LEARNED) != IRF_COUNT))
+      return(false);
+
+    _profile = profile;
+    EEPROM.update(EE_IR_PROFILE, _profile);
+    return(true);
+  }
+
+  void learn(void)
+  // Start learning codes for the key functions
+  {
+    PRINTS("\nIR learn start");
+    _bLearn = true;
+    _learnCount = 0;
+    _timeRpt = millis();
+    EEPROM.update(EE_IR_LEARNED, 0);
+    if (_profile == IR_PROFILE_LEARN)   // learned codes are being replaced
+      setProfile(IR_PROFILE_CARMP3);
+  }
+
+  inline uint8_t getProfile(void) { return(_profile); }
+  inline bool isLearning(void) { return(_bLearn); }
+  inline uint8_t getLearnCount(void) { return(_learnCount); }   // functions learned so far
+#if REPLAY_TRACE
+  inline void inject(uint32_t irCode) { _irInject = irCode; }    // replay an IR code
+#endif
+
+private:
+  uint8_t _pinIR;         // IR receiver pin
+  uint32_t _timeActive;   // last time the receiver was seen active
+  uint8_t _profile;       // IR_PROFILE_* in use
+  uint16_t _accum;        // accumulated digit value
+  bool _bAccum;           // digits have been entered
+  uint8_t _rptFunc;       // function to repeat, IRF_COUNT if none
+  uint32_t _timeRpt;      // time of the last key or repeat code received
+  uint32_t _timeNext;     // time the next repeat is due
+  bool _bLearn;           // learn mode active
+  uint8_t _learnCount;    // functions learned
+  bool _bBurst;           // a burst of IR activity is in progress
+  bool _bDecoded;         // a code was decoded in the burst
+  uint16_t _irCodes;      // IR codes decoded
+  uint16_t _irMalformed;  // IR bursts with no code decoded
+  IRReadOnlyRemote _IR;
+#if REPLAY_TRACE
+  uint32_t _irInject = 0; // replayed IR code
+#endif
+
+  uint8_t findCode(uint32_t irCode)
+  // Binary search the current profile for the code.
+  // Returns the IRF_* function or IRF_COUNT if not found.
+  {
+    const irKey_t *table = irCarMP3;
+    uint8_t lo = 0, hi;
+
+    switch (_profile)
+    {
+    case IR_PROFILE_CARMP3: table = irCarMP3; hi = ARRAY_SIZE(irCarMP3); break;
+    case IR_PROFILE_KEYES:  table = irKeyes;  hi = ARRAY_SIZE(irKeyes);  break;
+    default:                table = nullptr;  hi = IRF_COUNT;            break;
+    }
+
+    while (lo < hi)
+    {
+      uint8_t mid = (lo + hi) / 2;
+      uint8_t func;
+      uint32_t code;
+
+      if (table != nullptr)
+      {
+        code = pgm_read_dword(&table[mid].irCode);
+        func = pgm_read_byte(&table[mid].func);
+      }
+      else
+      {
+        func = EEPROM.read(EE_IR_INDEX + mid);
+        EEPROM.get(EE_IR_CODES + (func * sizeof(uint32_t)), code);
+      }
+
+      if (code == irCode)
+        return(func);
+      if (code < irCode)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    return(IRF_COUNT);
+  }
+
+  void setCommand(uint8_t func)
+  // Set the public command for the key function
+  {
+    irFunc_t f;
+
+    memcpy_P(&f, &irFunc[func], sizeof(f));
+    if (f.cmd != -1)
+    {
+      // actual command
+      c.cmd = f.cmd;
+      if (f.data == -1)
+      {
+        c.data = _accum;
+        _accum = 0;    // reset value
+        _bAccum = false;
+      }
+      else if (f.cmd == CMD_CLKFACE && _bAccum)
+      {
+        // digits entered select the face directly
+        c.data = (_accum < 9 ? '0' + _accum : CC_CYCLE);
+        _accum = 0;
+        _bAccum = false;
+      }
+      else
+      {
+        c.data = f.data;
+      }
+    }
+    else // f.cmd == -1 -> accumulator value
+    {
+      _accum = (_accum * 10) + f.data;
+      _bAccum = true;
+      PRINT(" new accum: ", _accum);
+    }
+  }
+
+  bool repeatCommand(void)
+  // Repeat the last CMD_VALUE while the key is held down
+  {
+    if (_rptFunc == IRF_COUNT)
+      return(false);
+
+    if (millis() - _timeRpt >= IR_RPT_TIMEOUT)
+    {
+      _rptFunc = IRF_COUNT;   // key released
+      return(false);
+    }
+
+    if ((int32_t)(millis() - _timeNext) < 0)
+      return(false);
+
+    _timeNext += IR_RPT_PERIOD;
+    setCommand(_rptFunc);
+    PRINT("\nIR: Rpt ", _rptFunc);
+
+    return(true);
+  }
+
+  void learnCode(uint32_t irCode)
+  // Save a new code for the next function being learned
+  {
+    if (irCode == 0 || irCode == IR_CODE_REPEAT)
+    {
+      if (millis() - _timeRpt >= IR_LEARN_TIMEOUT)
+      {
+        PRINTS("\nIR learn timeout");
+        _bLearn = false;
+        if (_learnCount != 0)
         {
-          accum = (accum * 10) + IRCodes[i].data;
-          PRINT(" new accum: ", accum);
+          // keep what was learned, the rest are unmapped
+          for (; _learnCount < IRF_COUNT; _learnCount++)
+            EEPROM.put(EE_IR_CODES + (_learnCount * sizeof(uint32_t)), IR_CODE_NONE);
+          learnDone();
         }
+      }
+      return;
+    }
+
+    // a code already learned skips the function
+    for (uint8_t i = 0; i < _learnCount; i++)
+    {
+      uint32_t code;
+
+      if (EEPROM.get(EE_IR_CODES + (i * sizeof(uint32_t)), code) == irCode)
+      {
+        irCode = IR_CODE_NONE;
         break;
       }
     }
 
-    return(c.cmd != 0);
+    PRINT("\nIR learn ", _learnCount);
+    PRINTX(" code ", irCode);
+    EEPROM.put(EE_IR_CODES + (_learnCount * sizeof(uint32_t)), irCode);
+    _timeRpt = millis();
+
+    if (++_learnCount < IRF_COUNT)
+      return;
+
+    _bLearn = false;
+    learnDone();
   }
 
-private:
-  typedef struct keyTable_t
+  void learnDone(void)
+  // Build the sorted index (insertion sort) for the learned codes and
+  // select the learned profile
   {
-    uint32_t  irCode;
-    int8_t    cmd;
-    int8_t    data;
-  };
+    uint8_t idx[IRF_COUNT];
 
-  IRReadOnlyRemote *_IR;
-  static const keyTable_t IRCodes[21];
-};
+    for (uint8_t i = 0; i < IRF_COUNT; i++)
+    {
+      uint32_t code;
+      uint8_t j = i;
 
-const IRemote::keyTable_t IRemote::IRCodes[] =
-{
-  { 0xFFA25D, CMD_RESET, 0 },    // On/Off
-  { 0xFF629D, CMD_SETUP, 0 },    // Mode
-  { 0xFFE21D, CMD_LAMPTEST, 0 }, // Mute
-  { 0xFF22DD, CMD_CLKFACE, CC_CYCLE }, // >||
-  { 0xFF02FD, CMD_SELECT, CS_PREV },   // |<<
-  { 0xFFC23D, CMD_SELECT, CS_NEXT },   // >>|
-  { 0xFFE01F, CMD_BRIGHT, -1 },     // EQ
-  { 0xFFA857, CMD_VALUE, CV_DOWN }, // -
-  { 0xFF906F, CMD_VALUE, CV_UP },   // +
-  { 0xFF9867, CMD_DEMO, CD_CYCLE }, // Shuffle
-  { 0xFFB04F, CMD_DEMO, CD_OFF },   // USD
-  { 0xFF6897, -1, 0 }, // 0
-  { 0xFF30CF, -1, 1 }, // 1
-  { 0xFF18E7, -1, 2 }, // 2
-  { 0xFF7A85, -1, 3 }, // 3
-  { 0xFF10EF, -1, 4 }, // 4
-  { 0xFF38C7, -1, 5 }, // 5
-  { 0xFF5AA5, -1, 6 }, // 6
-  { 0xFF42BD, -1, 7 }, // 7
-  { 0xFF4AB5, -1, 8 }, // 8
-  { 0xFF52AD, -1, 9 }, // 9
+      EEPROM.get(EE_IR_CODES + (i * sizeof(uint32_t)), code);
+      while (j > 0)
+      {
+        uint32_t prev;
+
+        EEPROM.get(EE_IR_CODES + (idx[j - 1] * sizeof(uint32_t)), prev);
+        if (prev < code) break;
+        idx[j] = idx[j - 1];
+        j--;
+      }
+      idx[j] = i;
+    }
+
+    for (uint8_t i = 0; i < IRF_COUNT; i++)
+      EEPROM.update(EE_IR_INDEX + i, idx[i]);
+
+    EEPROM.update(EE_IR_LEARNED, IRF_COUNT);
+    setProfile(IR_PROFILE_LEARN);
+    PRINTS("\nIR learn done");
+  }
 };
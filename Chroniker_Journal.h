@@ -0,0 +1,204 @@
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "Chroniker.h"
+
+/*
+Settings journal class
+
+Settings that should survive a power cycle or reset (brightness, clock
+face, demo) are kept in an append only journal in the EEPROM journal
+block. Each record is JNL_REC_SIZE bytes
+<SeqLo><SeqHi><Id><Value><CRC>
+where <Seq> is a sequence number incremented for every record, <Id> is
+the setting (JF_*), <Value> its value and <CRC> the CRC-8 of the other
+bytes. The CRC is written last, so a record torn by a power loss fails
+the check and the previous record for the setting is used.
+
+Records are written in turn around the block to spread the wear, and
+only for settings that have changed. Changes are held back until there
+have been none for JNL_DELAY, so a run of changes (eg, dragging the
+brightness slider) is one write. The latest record for a setting is
+never overwritten - its slot is skipped and the setting is written again
+after the new record, so old settings move around the block as well.
+
+begin() restores the latest value of each setting in a single scan of
+the block at startup, which also finds the next slot and sequence
+number. Sequence numbers are compared modulo 2^16, so they can wrap.
+*/
+
+// Journal settings
+enum jnlField_e { JF_BRIGHT, JF_CLKFACE, JF_DEMO, JF_COUNT };
+
+const uint8_t JNL_REC_SIZE = 5;       // bytes in a record
+const uint8_t JNL_SLOTS = EE_JNL_SIZE / JNL_REC_SIZE;  // records in the journal block
+const uint8_t JNL_NONE = 0xff;        // no record for the setting
+const uint8_t JNL_CRC_INIT = 0x5a;    // CRC start value, so blank (0xff) and zero records fail
+
+static_assert(JNL_SLOTS > JF_COUNT && JNL_SLOTS < JNL_NONE, "Journal block size does not suit the settings");
+static_assert(EE_JNL_BASE + EE_JNL_SIZE <= E2END + 1, "EEPROM map is bigger than the EEPROM");
+
+class SettingsJournal
+{
+public:
+  // Functions
+  SettingsJournal(void) : _next(0), _seq(0), _bPending(false) {};
+
+  void begin(uint8_t *val)
+  // Restore the latest value of each setting into val[], in a single
+  // scan of the journal. Settings with no record are left unchanged.
+  {
+    uint16_t seq[JF_COUNT];
+    uint16_t last = 0;
+    bool bFound = false;
+
+    for (uint8_t i = 0; i < JF_COUNT; i++)
+      _slot[i] = JNL_NONE;
+
+    for (uint8_t s = 0; s < JNL_SLOTS; s++)
+    {
+      uint16_t addr = slotAddr(s);
+      uint16_t n;
+      uint8_t id;
+
+      if (!isValid(s))
+        continue;
+
+      n = EEPROM.read(addr) | (EEPROM.read(addr + 1) << 8);
+      id = EEPROM.read(addr + 2);
+
+      // latest record of all, the next one goes after it
+      if (!bFound || (int16_t)(n - last) > 0)
+      {
+        bFound = true;
+        last = n;
+        _next = (s + 1) % JNL_SLOTS;
+      }
+
+      // latest record for the setting
+      if (_slot[id] == JNL_NONE || (int16_t)(n - seq[id]) > 0)
+      {
+        _slot[id] = s;
+        seq[id] = n;
+        val[id] = EEPROM.read(addr + 3);
+      }
+    }
+    _seq = bFound ? last + 1 : 0;
+
+    PRINT("\nJournal next ", _next);
+    PRINT(" seq ", _seq);
+  }
+
+  void check(const uint8_t *val)
+  // Note any changed settings in val[]. The settings are written JNL_DELAY
+  // after the last change.
+  {
+    for (uint8_t i = 0; i < JF_COUNT; i++)
+    {
+      if (_slot[i] == JNL_NONE || getSaved(i) != val[i])
+      {
+        _bPending = true;
+        _timeChange = millis();
+        break;
+      }
+    }
+  }
+
+  void run(const uint8_t *val)
+  // Write the changed settings once they have settled
+  {
+    if (_bPending && millis() - _timeChange >= JNL_DELAY)
+      flush(val);
+  }
+
+  void flush(const uint8_t *val)
+  // Write the changed settings in val[] now
+  {
+    _bPending = false;
+    for (uint8_t i = 0; i < JF_COUNT; i++)
+    {
+      if (_slot[i] == JNL_NONE || getSaved(i) != val[i])
+        append(i, val[i]);
+    }
+  }
+
+private:
+  uint8_t _slot[JF_COUNT];  // slot with the latest record for each setting
+  uint8_t _next;            // next slot to write
+  uint16_t _seq;            // next sequence number
+  bool _bPending;           // changed settings are waiting to be written
+  uint32_t _timeChange;     // time of the last change
+
+  inline uint16_t slotAddr(uint8_t s) { return(EE_JNL_BASE + (s * JNL_REC_SIZE)); }
+  inline uint8_t getSaved(uint8_t id) { return(EEPROM.read(slotAddr(_slot[id]) + 3)); }
+
+  uint8_t crc8(uint8_t crc, uint8_t data)
+  // Add data to the running CRC-8 (polynomial x^8 + x^2 + x + 1)
+  {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+
+    return(crc);
+  }
+
+  bool isValid(uint8_t s)
+  // Check the record in slot s
+  {
+    uint16_t addr = slotAddr(s);
+    uint8_t crc = JNL_CRC_INIT;
+
+    for (uint8_t i = 0; i < JNL_REC_SIZE - 1; i++)
+      crc = crc8(crc, EEPROM.read(addr + i));
+
+    return(crc == EEPROM.read(addr + JNL_REC_SIZE - 1) && EEPROM.read(addr + 2) < JF_COUNT);
+  }
+
+  void append(uint8_t id, uint8_t v)
+  // Add a record for the setting in the next free slot. Slots with the
+  // latest record of a setting are skipped and those other settings are
+  // carried forward after it, so no record is older than one lap.
+  {
+    uint8_t carry = 0;    // settings to carry forward, bit mask
+
+    for (uint8_t i = 0; i < JF_COUNT; )
+    {
+      if (_slot[i] != _next)
+        i++;
+      else
+      {
+        if (i != id) carry |= (1 << i);
+        _next = (_next + 1) % JNL_SLOTS;
+        i = 0;  // check the new slot
+      }
+    }
+    putRecord(id, v);
+
+    for (uint8_t i = 0; i < JF_COUNT; i++)
+    {
+      if (carry & (1 << i))
+        append(i, getSaved(i));
+    }
+  }
+
+  void putRecord(uint8_t id, uint8_t v)
+  // Write a record in the next slot, CRC last
+  {
+    uint16_t addr = slotAddr(_next);
+    uint8_t rec[JNL_REC_SIZE] = { (uint8_t)(_seq & 0xff), (uint8_t)(_seq >> 8), id, v, JNL_CRC_INIT };
+
+    for (uint8_t i = 0; i < JNL_REC_SIZE - 1; i++)
+      rec[JNL_REC_SIZE - 1] = crc8(rec[JNL_REC_SIZE - 1], rec[i]);
+    for (uint8_t i = 0; i < JNL_REC_SIZE; i++)
+      EEPROM.update(addr + i, rec[i]);
+
+    PRINT("\nJournal slot ", _next);
+    PRINT(" id ", id);
+    PRINT(" val ", v);
+
+    _slot[id] = _next;
+    _next = (_next + 1) % JNL_SLOTS;
+    _seq++;
+  }
+};
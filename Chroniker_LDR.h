@@ -0,0 +1,109 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Ambient light sensor class
+
+The LDR is sampled in the background so that no ADC conversion is waited
+for in the display update path. run() is called every time through loop()
+and works directly with the ADC registers:
+- a conversion is started every LDR_PERIOD ms.
+- on a later call, once the conversion has completed (ADSC clear), the
+  result is added to a running average that weights the last reading
+  1/LDR_SAMPLES. Only the sum is kept, so there is no sample buffer.
+The filtered reading only updates the ambient level when it has moved by
+more than LDR_HYSTERESIS counts, so LDR noise and flicker do not make the
+brightness hunt.
+
+Brightness gamma table
+----------------------
+The brightness setting (0-255, less the ambient adjustment) is mapped to
+the LED brightness by a PROGMEM table built at compile time. The table
+follows a gamma 2 curve, so equal steps in the setting look like equal
+steps in brightness, and is bounded by MIN_BRIGHTNESS and MAX_BRIGHTNESS.
+*/
+
+constexpr uint8_t brightGamma(uint16_t i)
+// LED brightness for setting i on a gamma 2 curve in MIN..MAX_BRIGHTNESS
+{
+  return(MIN_BRIGHTNESS + (((uint32_t)(MAX_BRIGHTNESS - MIN_BRIGHTNESS) * i * i) + (255L * 255 / 2)) / (255L * 255));
+}
+
+template<typename S> struct brightTable;
+template<uint16_t... I> struct brightTable<idxSeq<I...>>
+{
+  static const uint8_t data[sizeof...(I)];
+};
+template<uint16_t... I> const uint8_t brightTable<idxSeq<I...>>::data[sizeof...(I)] PROGMEM = { brightGamma(I)... };
+
+typedef brightTable<makeSeq<256>::type> brightLUT;
+
+#if USE_LDR_SENSOR
+class LDRSensor
+{
+public:
+  // Functions
+  LDRSensor(uint8_t pin) : _channel(pin - A0), _sum(0), _level(0), _bConvert(false) {};
+
+  void begin(void)
+  // Prime the filter with one blocking reading
+  {
+    uint16_t v;
+
+    pinMode(A0 + _channel, INPUT);
+    v = analogRead(A0 + _channel);
+    _sum = (uint16_t)v * LDR_SAMPLES;
+    _level = v;
+    _timeLast = millis();
+  }
+
+  void run(void)
+  // Start or collect an ADC conversion without waiting
+  {
+    if (_bConvert)
+    {
+      if (bit_is_set(ADCSRA, ADSC))   // still converting
+        return;
+
+      uint16_t v = ADC;
+
+      _bConvert = false;
+      _sum = _sum - (_sum / LDR_SAMPLES) + v;
+
+      // only move the level when outside the hysteresis band
+      v = _sum / LDR_SAMPLES;
+#if REPLAY_TRACE
+      if (_bInject) return;
+#endif
+      if (v > _level + LDR_HYSTERESIS || v + LDR_HYSTERESIS < _level)
+        _level = v;
+    }
+    else if (millis() - _timeLast >= LDR_PERIOD)
+    {
+      _timeLast = millis();
+      ADMUX = (1 << REFS0) | (_channel & 0x07);   // AVcc reference, right adjusted
+      ADCSRA |= (1 << ADSC);
+      _bConvert = true;
+    }
+  }
+
+  inline uint16_t getLevel(void) { return(_level); }          // filtered reading (0-1023)
+  inline uint8_t getAmbient(void) { return(_level / 8); }     // brightness reduction (0-127)
+#if REPLAY_TRACE
+  inline void inject(uint16_t level) { _level = level; _bInject = true; } // replay a level
+  inline void injectEnd(void) { _bInject = false; }  // back to the live sensor
+#endif
+
+private:
+  uint8_t  _channel;        // ADC channel
+  uint16_t _sum;            // running average * LDR_SAMPLES
+  uint16_t _level;          // filtered level with hysteresis
+  bool     _bConvert;       // conversion in progress
+  uint32_t _timeLast;       // time the last conversion was started
+#if REPLAY_TRACE
+  bool _bInject = false;    // level is set by the replay
+#endif
+};
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Loop stage profiler class
+
+Each profiled stage of the main loop is timed with micros() into a small
+histogram with PROF_BUCKETS fixed buckets on a log2 scale. Bucket 0
+counts times below PROF_BUCKET0 us, each following bucket covers double
+the time of the one before and the last bucket counts everything longer.
+The longest time for each stage is also kept.
+
+Counters are 16 bit. When one of the buckets for a stage is full, all
+the buckets for that stage are halved, so the histogram keeps its shape
+and the most recent activity carries the most weight.
+
+The overhead is two micros() calls and a few shifts for each stage, so
+the profiler can be left compiled in. The histograms are returned to the
+BT master by the CMD_DIAG command.
+*/
+
+const uint8_t PROF_BUCKETS = 8;   // histogram buckets per stage
+const uint8_t PROF_BUCKET0 = 16;  // upper limit of bucket 0 in us - must be a power of 2
+
+// Profiled stages
+enum profStage_e { PROF_LOOP, PROF_INPUT, PROF_DISPATCH, PROF_FSM, PROF_SHOW, PROF_STAGES };
+
+// Histogram for one stage, as sent to the BT master
+typedef struct
+{
+  uint16_t count[PROF_BUCKETS]; // bucket counts
+  uint16_t timeMax;             // longest time (us, saturates at 65535)
+} profHist_t;
+
+class Profiler
+{
+public:
+  // Functions
+  Profiler(void) { reset(); };
+
+  inline uint32_t start(void) { return(micros()); }
+
+  void stop(uint8_t stage, uint32_t timeStart)
+  // Add the time since timeStart to the stage histogram
+  {
+    uint32_t t = micros() - timeStart;
+    profHist_t *h = &_hist[stage];
+    uint8_t b = 0;
+
+    if (t > h->timeMax)
+      h->timeMax = (t > 0xffff ? 0xffff : t);
+
+    // log2 bucket
+    for (t /= PROF_BUCKET0; t != 0 && b < PROF_BUCKETS - 1; t >>= 1)
+      b++;
+
+    if (h->count[b] == 0xffff)
+    {
+      for (uint8_t i = 0; i < PROF_BUCKETS; i++)
+        h->count[i] >>= 1;
+    }
+    h->count[b]++;
+  }
+
+  void reset(void)
+  {
+    memset(_hist, 0, sizeof(_hist));
+  }
+
+  inline const profHist_t *getHist(uint8_t stage) { return(&_hist[stage]); }
+
+private:
+  profHist_t _hist[PROF_STAGES];
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Command queue class
+
+A statically sized ring of commands for one input source. There must be
+only one producer (push) and one consumer (pop). The producer may run in
+an interrupt handler as the head index is only changed by the producer
+and the tail index only by the consumer. The consumer must not run in an
+interrupt handler, as coalescing in push() relies on the tail not moving
+while it runs. SIZE must be a power of 2 and the ring holds SIZE-1
+commands.
+
+Redundant commands are coalesced into the last command queued:
+- successive CMD_BRIGHT values replace the last value, as only the latest
+  one matters.
+- repeated CMD_VALUE steps in the same direction increment a repeat count
+  and are returned by pop() once for each repeat.
+The last command is only changed when at least 2 commands are queued, so
+it can never be the one being read by the consumer.
+
+Commands that do not fit are dropped and counted, as are the coalesced
+commands. The high water mark of the ring is also recorded.
+*/
+
+template<uint8_t SIZE> class CmdRing
+{
+  static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "CmdRing SIZE must be a power of 2");
+
+public:
+  // Functions
+  CmdRing(void) : _head(0), _tail(0), _dropped(0), _coalesced(0), _highWater(0) {};
+
+  bool push(const cmdQ_t &cq)
+  // Producer: add a command to the ring.
+  // Returns false if the command was dropped.
+  {
+    uint8_t head = _head;
+    uint8_t count = (head - _tail) & (SIZE - 1);
+
+    if (count >= 2)
+    {
+      uint8_t last = (head - 1) & (SIZE - 1);
+
+      if (cq.cmd == _buf[last].cmd)
+      {
+        if (cq.cmd == CMD_BRIGHT)
+        {
+          _buf[last].data = cq.data;
+          _coalesced++;
+          return(true);
+        }
+        if (cq.cmd == CMD_VALUE && cq.data == _buf[last].data && _rpt[last] < 0xff)
+        {
+          _rpt[last]++;
+          _coalesced++;
+          return(true);
+        }
+      }
+    }
+
+    if (count >= SIZE - 1)
+    {
+      _dropped++;
+      return(false);
+    }
+
+    _buf[head] = cq;
+    _rpt[head] = 1;
+    if (count + 1 > _highWater) _highWater = count + 1;
+    __asm__ __volatile__("" ::: "memory");  // command stored before it is published
+    _head = (head + 1) & (SIZE - 1);
+
+    return(true);
+  }
+
+  bool push(uint8_t cmd, uint32_t data)
+  // Producer: add a command from its parts
+  {
+    cmdQ_t cq;
+
+    cq.cmd = cmd;
+    cq.data = data;
+    return(push(cq));
+  }
+
+  bool pop(cmdQ_t &cq)
+  // Consumer: get the next command, once for each repeat.
+  // Returns false if the ring is empty.
+  {
+    uint8_t tail = _tail;
+
+    if (tail == _head)
+      return(false);
+
+    cq = _buf[tail];
+    if (--_rpt[tail] == 0)
+    {
+      __asm__ __volatile__("" ::: "memory");  // command read before the slot is released
+      _tail = (tail + 1) & (SIZE - 1);
+    }
+
+    return(true);
+  }
+
+  inline bool isEmpty(void) { return(_head == _tail); }
+  inline uint16_t getDropped(void) { return(_dropped); }
+  inline uint16_t getCoalesced(void) { return(_coalesced); }
+  inline uint8_t getHighWater(void) { return(_highWater); }
+
+private:
+  cmdQ_t  _buf[SIZE];         // queued commands
+  uint8_t _rpt[SIZE];         // repeat count for each command
+  volatile uint8_t _head;     // next free slot, changed by the producer
+  volatile uint8_t _tail;     // next command, changed by the consumer
+  uint16_t _dropped;          // commands lost as the ring was full
+  uint16_t _coalesced;        // commands merged into the last one queued
+  uint8_t  _highWater;        // most commands queued at once
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Arduino.h>
+#include <MD_KeySwitch.h>
+#include "Chroniker.h"
+
+/*
+Input trace replay
+
+With REPLAY_TRACE set in Chroniker.h, the trace of input events in
+replayTrace[] is played into the unmodified application at startup and
+the response is measured. Each event is injected at its time (ms from the
+start of the replay) at the lowest level the firmware allows:
+- RP_BT  - characters fed to the BT packet parser, as if received.
+- RP_IR  - an IR code, as if returned by the IR receiver library.
+- RP_SW  - a MD_KeySwitch key result from the mode switch.
+- RP_LDR - a filtered LDR level (0-1023) for the ambient light.
+- RP_RTC - the RTC time (data 0x00HHMMSS) written to the RTC.
+RP_END marks the end of the trace.
+
+For each event the latency from the injection to the first LED update
+sent to the hardware (FastLED.show()) after the event has taken effect
+is measured, along with the hash of that frame. An event takes effect
+when its first command is processed, or straight away for RP_LDR and 
+RP_RTC events, so earlier frames (eg, a clock tick) are not counted. If the event has a golden hash it is compared with the
+frame. Set golden to 0 to skip the check - the hashes reported by a
+good run can be copied into the trace to use for regression testing.
+Results for each event and a summary are printed to the Serial monitor.
+
+This runs on the real hardware in real time, as there is no host build
+in this project. Most changes are only shown on the next clock tick, so
+events should be spaced more than a second apart to get a frame each.
+The time shown depends on when the events land relative to the RTC 
+seconds, so golden hashes are only repeatable for frames that do not 
+show the running seconds (eg, the lamp test). The golden hash in the 
+sample trace is for the default LED ring configuration.
+*/
+
+// Event types
+enum replayType_e { RP_END, RP_BT, RP_IR, RP_SW, RP_LDR, RP_RTC };
+
+const uint16_t REPLAY_TIMEOUT = 2000;  // ms to wait for a frame after an event
+
+typedef struct
+{
+  uint16_t time;    // ms from the start of the replay
+  uint8_t type;     // RP_* event type
+  uint32_t data;    // event data
+  const char *str;  // RP_BT characters in PROGMEM
+  uint32_t golden;  // expected frame hash, 0 for no check
+} replayEvent_t;
+
+// Sample trace
+const char PROGMEM rpFace0[] = "*C0~";
+const char PROGMEM rpFace2[] = "*C2~";
+const char PROGMEM rpBright[] = "*B255~";
+const char PROGMEM rpSetup[] = "*X~*V1~*V1~*S0~*S0~";
+const char PROGMEM rpLamp[] = "*L~";
+
+const replayEvent_t PROGMEM replayTrace[] =
+{
+  { 0,     RP_RTC, 0x00030000, nullptr, 0 },  // 3:00:00
+  { 1200,  RP_LDR, 0, nullptr, 0 },           // bright room
+  { 2400,  RP_BT,  0, rpFace2, 0 },           // pie face
+  { 3600,  RP_BT,  0, rpFace0, 0 },           // standard face
+  { 4800,  RP_BT,  0, rpBright, 0 },          // full brightness
+  { 6000,  RP_LDR, 1023, nullptr, 0 },        // dark room
+  { 7200,  RP_IR,  0xFF22DD, nullptr, 0 },    // Car MP3 >|| next face
+  { 8400,  RP_SW,  MD_KeySwitch::KS_DPRESS, nullptr, 0 },    // setup mode
+  { 8600,  RP_SW,  MD_KeySwitch::KS_PRESS, nullptr, 0 },     // hour + 1
+  { 8800,  RP_SW,  MD_KeySwitch::KS_LONGPRESS, nullptr, 0 }, // minutes
+  { 9000,  RP_SW,  MD_KeySwitch::KS_LONGPRESS, nullptr, 0 }, // done
+  { 10200, RP_BT,  0, rpSetup, 0 },           // setup over BT
+  { 11400, RP_BT,  0, rpLamp, 0x8D6800C8 },   // lamp test, blank frame
+  { 13000, RP_END, 0, nullptr, 0 },
+};
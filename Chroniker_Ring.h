@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+LED ring geometry
+
+The LED rings are set up in Chroniker.h (RING_SIZE and RING_SHOW) as one
+or more rings chained on the LED data line, each a multiple of 12 LEDs.
+Time is mapped onto a ring through a dial of DIAL_UNITS (60) units - one
+unit per minute or second, 5 units per hour.
+
+Everything that needs a division is worked out at compile time into
+PROGMEM tables, so rendering a frame only needs table lookups:
+- ringLUT::pos[] is the LED for each dial unit on each ring.
+- ringLUT::creep[] is the LEDs the hour hand has moved on from the hour
+  after each minute.
+- ringGeomLUT::data[] has the first LED, number of LEDs, what is shown
+  and a 16.16 scale from dial units to LEDs for each ring, used to place
+  the smooth face hands at fractions of a unit with a multiply and shift.
+*/
+
+const uint8_t DIAL_UNITS = 60;  // dial units in one revolution
+
+// Ring geometry, as used by the rendering kernels
+typedef struct
+{
+  uint8_t first;    // first LED of the ring
+  uint8_t count;    // number of LEDs on the ring
+  uint8_t show;     // RING_* items shown on the ring
+  uint32_t scale;   // LEDs per dial unit, 16.16 fixed point
+} ringGeom_t;
+
+constexpr uint8_t ringOf(uint16_t led, uint8_t r = 0)
+// ring for LED led
+{
+  return((r + 1 < RING_COUNT && led >= ringStart(r + 1)) ? ringOf(led, r + 1) : r);
+}
+
+constexpr uint8_t ringPos(uint8_t r, uint8_t unit)
+// LED for the dial unit on ring r
+{
+  return(ringStart(r) + ((uint16_t)unit * RING_SIZE[r]) / DIAL_UNITS);
+}
+
+constexpr uint8_t ringCreep(uint8_t r, uint8_t minute)
+// LEDs the hour hand moves on ring r from the hour after minute
+{
+  return(((uint16_t)minute * RING_SIZE[r]) / (12 * DIAL_UNITS));
+}
+
+// Dial unit lookup tables for all the rings
+template<typename S> struct ringTable;
+template<uint16_t... I> struct ringTable<idxSeq<I...>>
+{
+  static const uint8_t pos[sizeof...(I)];
+  static const uint8_t creep[sizeof...(I)];
+};
+template<uint16_t... I> const uint8_t ringTable<idxSeq<I...>>::pos[sizeof...(I)] PROGMEM = { ringPos(I / DIAL_UNITS, I % DIAL_UNITS)... };
+template<uint16_t... I> const uint8_t ringTable<idxSeq<I...>>::creep[sizeof...(I)] PROGMEM = { ringCreep(I / DIAL_UNITS, I % DIAL_UNITS)... };
+
+typedef ringTable<makeSeq<RING_COUNT * DIAL_UNITS>::type> ringLUT;
+
+// Ring geometry table
+template<typename S> struct ringGeom;
+template<uint16_t... I> struct ringGeom<idxSeq<I...>>
+{
+  static const ringGeom_t data[sizeof...(I)];
+};
+template<uint16_t... I> const ringGeom_t ringGeom<idxSeq<I...>>::data[sizeof...(I)] PROGMEM =
+{
+  { (uint8_t)ringStart(I), RING_SIZE[I], RING_SHOW[I], ((uint32_t)RING_SIZE[I] << 16) / DIAL_UNITS }...
+};
+
+typedef ringGeom<makeSeq<RING_COUNT>::type> ringGeomLUT;
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Time synchronisation class
+
+The BT master keeps the clock in step with its own (network) time in
+two steps:
+- It sends CMD_ECHO with its own timestamp, which is returned straight
+  away with the clock millis(). The master measures the round trip time
+  (RTT) and repeats this a few times to find the shortest.
+- It sends CMD_SYNC with its time of day to the millisecond, plus RTT/2
+  so the time is right when the packet arrives.
+The application measures the offset of the RTC from the synchronised
+time (the RTC seconds plus the ms since the last tick), then writes the
+new time to the RTC on the next whole second. Writing the seconds resets
+the DS3231 countdown chain, so the RTC ticks in step with the master.
+
+As the clock is set at every sync, the offset at a sync is the drift
+since the last one. The last SYNC_HISTORY offsets are kept for the
+diagnostics, and the drift is added up from the first sync after the
+aging offset was last changed. Once that covers at least SYNC_CAL_TIME
+the drift rate is worked out and the DS3231 aging offset is corrected.
+One aging offset LSB is about 0.1ppm, and positive values slow the
+oscillator. A time set any other way (switch, CMD_TIME) or a big step
+at a sync (over SYNC_STEP_MAX, eg, a time zone change) is not drift, so
+the sum is started again from the next sync.
+*/
+
+const uint8_t SYNC_HISTORY = 4;          // offset records kept
+const uint32_t SYNC_CAL_TIME = 86400;    // s of drift needed before the aging offset is corrected
+const int16_t SYNC_STEP_MAX = 5000;      // ms offset above which a sync is a time change, not drift
+const int32_t SYNC_DAY = 43200000;       // ms in the 12 hour clock dial
+
+// Offset history record, as sent to the BT master
+typedef struct
+{
+  uint16_t time;    // millis()/60000 at the sync
+  int16_t offset;   // RTC time less the synchronised time (ms), limited to +/-32767
+} syncRec_t;
+
+class TimeSync
+{
+public:
+  // Functions
+  TimeSync(void) : _head(0), _count(0), _aging(0), _bCal(false) {};
+
+  void begin(int8_t aging)
+  // Start with the aging offset held in the RTC
+  {
+    _aging = aging;
+    PRINT("\nSync aging ", _aging);
+  }
+
+  void manual(void)
+  // The time has been set by hand, start the drift sum again at the next sync
+  {
+    _bCal = false;
+  }
+
+  bool add(int32_t offset)
+  // Record the offset measured at a sync and work out the aging offset.
+  // Returns true if the aging offset has changed.
+  {
+    uint32_t now = millis() / 1000;
+    int32_t delta;
+
+    _hist[_head].time = now / 60;
+    _hist[_head].offset = constrain(offset, -32767, 32767);
+    _head = (_head + 1) % SYNC_HISTORY;
+    if (_count < SYNC_HISTORY) _count++;
+
+    PRINT("\nSync offset ", offset);
+
+    if (!_bCal || abs(offset) > SYNC_STEP_MAX)
+    {
+      // start the drift sum from this sync
+      _bCal = true;
+      _calStart = now;
+      _calSum = 0;
+      return(false);
+    }
+
+    _calSum += offset;
+    if (now - _calStart < SYNC_CAL_TIME)
+      return(false);
+
+    // 0.1ppm per LSB, ms/s * 10000 = 0.1ppm
+    delta = (_calSum * 10000) / (int32_t)(now - _calStart);
+    _calStart = now;
+    _calSum = 0;
+    if (delta == 0)
+      return(false);
+
+    _aging = constrain(_aging + delta, -128, 127);
+    PRINT(" aging ", _aging);
+    return(true);
+  }
+
+  inline int8_t getAging(void) { return(_aging); }
+  inline uint8_t getCount(void) { return(_count); }
+  inline const syncRec_t *getHistory(void) { return(_hist); }   // history ring, in slot order
+
+private:
+  syncRec_t _hist[SYNC_HISTORY];  // offset history ring
+  uint8_t _head;      // next record to use
+  uint8_t _count;     // records in the history
+  int8_t _aging;      // DS3231 aging offset in use
+
+  // drift since the aging offset was last worked out
+  bool _bCal;         // drift is being added up
+  uint32_t _calStart; // millis()/1000 at the start
+  int32_t _calSum;    // total drift (ms)
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Chroniker.h"
+
+/*
+Cooperative task scheduler class
+
+The application is split into tasks that each do a short piece of work and
+return - no task may wait with delay() or a busy loop. The tasks are held
+in a table in the main program and run() is called from loop() to run,
+in table order, each active task that is due.
+
+Each task has a period in ms. A period of 0 runs the task every time
+through run(), otherwise the task is due on a fixed time grid of the
+period, its deadline. If a task is more than a period late the grid is
+moved forward so that missed runs are not made up. Tasks are started
+(optionally after a delay) and stopped at any time, including by
+themselves.
+
+With PROFILE_DEBUG set in Chroniker.h, run time accounting is kept for
+each task: the number of runs, the average and maximum run time, the
+worst lateness past the deadline and the maximum interval between runs,
+all in microseconds. The maximum interval for the input polling task is
+the worst case input latency. The accounting costs 24 bytes of SRAM
+for each task and is only printed with the debug output.
+*/
+
+// Task definition and accounting
+typedef struct
+{
+  void (*fn)(void);   // task function
+  uint16_t period;    // ms between runs, 0 to run every pass
+  bool bActive;       // task is scheduled to run
+  uint32_t timeNext;  // deadline for the next run (ms)
+
+#if PROFILE_DEBUG
+  // accounting
+  uint32_t runs;      // number of runs
+  uint32_t timeSum;   // total run time (us)
+  uint32_t timeMax;   // longest run time (us)
+  uint32_t lateMax;   // worst lateness past the deadline (us)
+  uint32_t gapMax;    // longest interval between runs (us)
+  uint32_t timeLast;  // start time of the last run (us)
+#endif
+} task_t;
+
+class TaskScheduler
+{
+public:
+  // Functions
+  TaskScheduler(task_t *task, uint8_t count) : _task(task), _count(count) {};
+
+  void begin(void)
+  // Clear the accounting and set the deadlines for the active tasks
+  {
+    for (uint8_t i = 0; i < _count; i++)
+    {
+      _task[i].timeNext = millis();
+#if PROFILE_DEBUG
+      resetStats(i);
+#endif
+    }
+  }
+
+  void run(void)
+  // Run all the active tasks that are due, in table order
+  {
+    for (uint8_t i = 0; i < _count; i++)
+    {
+      task_t *t = &_task[i];
+      uint32_t now = millis();
+#if PROFILE_DEBUG
+      uint32_t start;
+#endif
+
+      if (!t->bActive)
+        continue;
+
+      if (t->period != 0)
+      {
+        if ((int32_t)(now - t->timeNext) < 0)
+          continue;
+
+        // deadline accounting and the next deadline
+#if PROFILE_DEBUG
+        if ((now - t->timeNext) * 1000 > t->lateMax)
+          t->lateMax = (now - t->timeNext) * 1000;
+#endif
+        t->timeNext += t->period;
+        if ((int32_t)(now - t->timeNext) >= 0)  // more than a period late
+          t->timeNext = now + t->period;
+      }
+
+#if PROFILE_DEBUG
+      start = micros();
+      if (t->runs != 0 && start - t->timeLast > t->gapMax)
+        t->gapMax = start - t->timeLast;
+      t->timeLast = start;
+#endif
+
+      t->fn();
+
+#if PROFILE_DEBUG
+      start = micros() - start;
+      t->timeSum += start;
+      if (start > t->timeMax) t->timeMax = start;
+      t->runs++;
+#endif
+    }
+  }
+
+  void start(uint8_t id, uint16_t wait = 0)
+  // Start the task, first run after wait ms
+  {
+    if (id >= _count) return;
+    _task[id].timeNext = millis() + wait;
+    _task[id].bActive = true;
+  }
+
+  void stop(uint8_t id)
+  // Stop the task
+  {
+    if (id >= _count) return;
+    _task[id].bActive = false;
+  }
+
+  inline bool isActive(uint8_t id) { return(id < _count && _task[id].bActive); }
+  inline void setPeriod(uint8_t id, uint16_t period) { if (id < _count) _task[id].period = period; }
+  inline uint16_t getPeriod(uint8_t id) { return(id < _count ? _task[id].period : 0); }
+
+#if PROFILE_DEBUG
+  // Run time accounting
+  inline uint32_t getRuns(uint8_t id) { return(_task[id].runs); }
+  inline uint32_t getTimeAvg(uint8_t id) { return(_task[id].runs != 0 ? _task[id].timeSum / _task[id].runs : 0); }
+  inline uint32_t getTimeMax(uint8_t id) { return(_task[id].timeMax); }
+  inline uint32_t getLateMax(uint8_t id) { return(_task[id].lateMax); }
+  inline uint32_t getGapMax(uint8_t id) { return(_task[id].gapMax); }
+
+  void resetStats(uint8_t id)
+  {
+    _task[id].runs = _task[id].timeSum = _task[id].timeMax = 0;
+    _task[id].lateMax = _task[id].gapMax = 0;
+  }
+
+  void report(void)
+  // Print and reset the accounting for all tasks
+  {
+    for (uint8_t i = 0; i < _count; i++)
+    {
+      PRINT("\nTask ", i);
+      PRINT(" runs:", _task[i].runs);
+      PRINT(" avg us:", getTimeAvg(i));
+      PRINT(" max us:", _task[i].timeMax);
+      PRINT(" late us:", _task[i].lateMax);
+      PRINT(" gap us:", _task[i].gapMax);
+      resetStats(i);
+    }
+  }
+#else
+  inline void report(void) {}
+#endif
+
+private:
+  task_t *_task;    // task table
+  uint8_t _count;   // number of tasks
+};
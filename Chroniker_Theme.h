@@ -0,0 +1,142 @@
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "Chroniker.h"
+
+/*
+Colour theme class
+
+The clock faces are not drawn in colours but into a pixel buffer of one
+byte per LED. The low nibble of each byte is an index into the palette
+(PAL_* in Chroniker.h) and the high nibble is the intensity, from 0 to
+15 (full), used to anti-alias the smooth face hands. The pixel buffer is
+expanded into the CRGB LED buffer from the palette only when the frame
+is sent to the LEDs.
+
+A theme is the set of colours for the palette. The built in themes are
+held in PROGMEM and one user theme is held in EEPROM, where each colour
+can be changed from the BT master (CMD_COLOUR) without reflashing. As
+the pixel buffer does not change, a new theme only needs the palette to
+be loaded and the current frame expanded again - there is no redraw.
+The selected theme is saved in EEPROM.
+*/
+
+// Pixel buffer entry for palette index pal at intensity level (0-15)
+constexpr uint8_t pixel(uint8_t pal, uint8_t level = 15) { return((level << 4) | pal); }
+
+const uint8_t PIX_FULL = pixel(PAL_OFF);  // intensity bits for full brightness
+
+// Built in themes, colours in palette order
+const uint32_t PROGMEM themeTable[][PAL_COUNT] =
+{
+  // classic
+  { COL_OFF, COL_MMARK, COL_HMARK, COL_12HMARK, COL_HHAND, COL_MHAND, COL_SHAND },
+  // ocean
+  { CRGB::Black, CRGB::Black, CRGB::Navy, CRGB::Teal, CRGB::Aqua, CRGB::DodgerBlue, CRGB::White },
+  // warm
+  { CRGB::Black, CRGB::Black, CRGB::DarkRed, CRGB::Red, CRGB::Gold, CRGB::OrangeRed, CRGB::Yellow },
+  // night - dim reds only
+  { 0x000000, 0x000000, 0x100000, 0x300000, 0x800000, 0x600000, 0x200000 },
+};
+
+const uint8_t THEME_COUNT = ARRAY_SIZE(themeTable); // number of built in themes
+const uint8_t THEME_USER = CT_USER - '0';           // theme number for the user theme
+
+// EEPROM layout for the theme block
+const uint16_t EE_THEME_SIG = EE_THEME_BASE;         // signature byte, EE_THEME_SIGNATURE when valid
+const uint16_t EE_THEME_SEL = EE_THEME_BASE + 1;     // selected theme
+const uint16_t EE_THEME_USER = EE_THEME_BASE + 2;    // user theme colours, r, g, b in palette order
+const uint8_t EE_THEME_SIGNATURE = 0x5a;
+
+static_assert(THEME_COUNT <= THEME_USER, "Too many built in themes");
+static_assert(PAL_COUNT <= 16, "Palette index must fit in a nibble");
+static_assert(EE_THEME_USER + (PAL_COUNT * 3) <= EE_THEME_BASE + EE_THEME_SIZE, "User theme does not fit EEPROM block");
+
+class Theme
+{
+public:
+  // Functions
+  Theme(void) : _theme(0) {};
+
+  void begin(void)
+  // Restore the theme saved in EEPROM, setting up the user theme on first use
+  {
+    if (EEPROM.read(EE_THEME_SIG) != EE_THEME_SIGNATURE)
+    {
+      for (uint8_t i = 0; i < PAL_COUNT; i++)
+        putColour(i, pgm_read_dword(&themeTable[0][i]));
+      EEPROM.update(EE_THEME_SEL, 0);
+      EEPROM.update(EE_THEME_SIG, EE_THEME_SIGNATURE);
+    }
+    if (!select(EEPROM.read(EE_THEME_SEL)))
+      select(0);
+    PRINT("\nTheme ", _theme);
+  }
+
+  bool select(uint8_t theme)
+  // Load the palette for the theme and save the selection in EEPROM.
+  // Returns false if the theme does not exist.
+  {
+    if (theme != THEME_USER && theme >= THEME_COUNT)
+      return(false);
+
+    _theme = theme;
+    for (uint8_t i = 0; i < PAL_COUNT; i++)
+    {
+      if (_theme == THEME_USER)
+      {
+        _pal[i].r = EEPROM.read(EE_THEME_USER + (i * 3));
+        _pal[i].g = EEPROM.read(EE_THEME_USER + (i * 3) + 1);
+        _pal[i].b = EEPROM.read(EE_THEME_USER + (i * 3) + 2);
+      }
+      else
+        _pal[i] = pgm_read_dword(&themeTable[_theme][i]);
+    }
+    EEPROM.update(EE_THEME_SEL, _theme);
+
+    return(true);
+  }
+
+  bool setColour(uint8_t entry, uint32_t rgb)
+  // Change a user theme colour, and the palette if the user theme is in use.
+  // Returns true if the palette has changed.
+  {
+    if (entry >= PAL_COUNT)
+      return(false);
+
+    putColour(entry, rgb);
+    if (_theme != THEME_USER)
+      return(false);
+
+    _pal[entry] = rgb;
+    return(true);
+  }
+
+  inline uint8_t getTheme(void) { return(_theme); }
+
+  void expand(const uint8_t *pix, CRGB *led, uint8_t count)
+  // Expand the pixel buffer into the LED buffer using the palette
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      uint8_t p = pix[i];
+
+      led[i] = _pal[p & 0x0f];
+      if ((p & 0xf0) != PIX_FULL)
+        led[i].nscale8_video((p & 0xf0) | (p >> 4));
+    }
+  }
+
+private:
+  uint8_t _theme;         // theme in use
+  CRGB _pal[PAL_COUNT];   // palette for the theme in use
+
+  void putColour(uint8_t entry, uint32_t rgb)
+  // Save a user theme colour in EEPROM
+  {
+    EEPROM.update(EE_THEME_USER + (entry * 3), (rgb >> 16) & 0xff);
+    EEPROM.update(EE_THEME_USER + (entry * 3) + 1, (rgb >> 8) & 0xff);
+    EEPROM.update(EE_THEME_USER + (entry * 3) + 2, rgb & 0xff);
+  }
+};
@@ -16,28 +16,30 @@ class UISwitch: public iChroniker
 {
 public:
   // Functions
-  UISwitch(uint8_t pinMode, uint8_t logicMode)
+  UISwitch(uint8_t pinMode, uint8_t logicMode) : _swMode(pinMode, logicMode)
   {
     c.cmd = c.data = 0;
-    _swMode = new MD_KeySwitch(pinMode, logicMode);
-  };
-
-  ~UISwitch() 
-  { 
-    delete _swMode;
   };
 
   virtual void begin(void)
   // initialise library
   {
-    _swMode->begin();
-    _swMode->enableRepeat(false);
+    _swMode.begin();
+    _swMode.enableRepeat(false);
   }
 
   virtual bool getCommand(void)
   // Returns true if a keypress was processed and saved to public variables.
   {
-    MD_KeySwitch::keyResult_t k = _swMode->read();
+    MD_KeySwitch::keyResult_t k = _swMode.read();
+
+#if REPLAY_TRACE
+    if (_kInject != MD_KeySwitch::KS_NULL)
+    {
+      k = _kInject;
+      _kInject = MD_KeySwitch::KS_NULL;
+    }
+#endif
 
     if (k == MD_KeySwitch::KS_NULL) 
     {
@@ -57,6 +59,13 @@ public:
     return(c.cmd != 0);
   }
 
+#if REPLAY_TRACE
+  inline void inject(MD_KeySwitch::keyResult_t k) { _kInject = k; } // replay a key result
+#endif
+
 private:
-  MD_KeySwitch* _swMode;
+  MD_KeySwitch _swMode;
+#if REPLAY_TRACE
+  MD_KeySwitch::keyResult_t _kInject = MD_KeySwitch::KS_NULL; // replayed key result
+#endif
 };